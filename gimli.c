@@ -6,419 +6,5712 @@
 #include "gimli.h"
 
 
+/* Field names of the metrics kept in gimli.hist, in sample order. */
+static const char *const hist_cpu[] = {
+    "us", "ni", "sy", "id", "wa", "hi", "si", "st"
+};
+static const char *const hist_load[] = { "1m", "5m", "15m" };
+static const char *const hist_mem[] = {
+    "total", "free", "shared", "buffer", "swap_total", "swap_free",
+    "high_total", "high_free", "avail", "cached"
+};
+static const char *const hist_procs[] = { "procs" };
+
+#define HIST(n, f, p) { .name = (n), .fields = (f), \
+    .nfields = sizeof (f) / sizeof ((f)[0]), .prec = (p) }
+
 /* Global stats data, updated by the mine() threads. */
-gimli_t           gimli;
+gimli_t           gimli = {
+    .hist = {
+        [HIST_CPU]   = HIST("cpu", hist_cpu, 1),
+        [HIST_LOAD]  = HIST("load", hist_load, 2),
+        [HIST_MEM]   = HIST("mem", hist_mem, 0),
+        [HIST_PROCS] = HIST("procs", hist_procs, 0),
+    }
+};
+
+/* Runtime configuration, set from the command line. */
+gimli_conf_t      conf = {
+    .history = HISTORY_LEN,
+    .backlog = SOMAXCONN,
+};
+
+/* Publication lock for gimli, see gimli_write_begin(). */
+gimli_seq_t       gimli_seq = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Pre-rendered responses, replaced whenever gimli is published. */
+gimli_cache_t     cache = { .epoch = 1 };
+
+/* Route lookup table, built once by router_init(). */
+gimli_router_t    router;
+
+/* HTTP server state and counters, updated by the event loops. */
+gimli_server_t    server;
+
+static void cache_publish(unsigned dirty);
+static gimli_buf_t *handle_stream(gimli_conn_t *, const gimli_http_t *);
+static int64_t stream_send(gimli_conn_t *conn, int64_t now);
+static void stream_flush(gimli_loop_t *loop);
+static gimli_buf_t *handle_ws(gimli_conn_t *, const gimli_http_t *);
+static size_t ws_process(gimli_conn_t *conn, char *p, size_t len);
+
+
+/**
+ * gimli_write_begin - start publishing new values into gimli
+ *
+ * Must be paired with gimli_write_end(). Keep the section short: only
+ * copy already computed values in, never sample or block inside it.
+ */
+static void
+gimli_write_begin(void)
+{
+    unsigned seq;
+
+    pthread_mutex_lock(&gimli_seq.lock);
+    seq = atomic_load_explicit(&gimli_seq.seq, memory_order_relaxed);
+    atomic_store_explicit(&gimli_seq.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * gimli_write_end - finish publishing, making the new values visible
+ *
+ * dirty is the set of RESP_BIT()s of cached responses that depend on
+ * what was written; they are re-rendered before the lock is dropped.
+ */
+static void
+gimli_write_end(unsigned dirty)
+{
+    unsigned seq;
+
+    seq = atomic_load_explicit(&gimli_seq.seq, memory_order_relaxed);
+    atomic_store_explicit(&gimli_seq.seq, seq + 1, memory_order_release);
+    cache_publish(dirty);
+    pthread_mutex_unlock(&gimli_seq.lock);
+}
+
+/**
+ * gimli_read_begin - start a lock-free read of gimli
+ *
+ * Returns the sequence to hand to gimli_read_retry() once done. Spins
+ * while a writer is in the middle of an update.
+ */
+static unsigned
+gimli_read_begin(void)
+{
+    unsigned seq;
+
+    while ((seq = atomic_load_explicit(&gimli_seq.seq,
+                    memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return (seq);
+}
+
+/**
+ * gimli_read_retry - check whether a read raced with a writer
+ *
+ * Returns non-zero when the values read since gimli_read_begin() may be
+ * torn and must be read again.
+ */
+static int
+gimli_read_retry(unsigned seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return (atomic_load_explicit(&gimli_seq.seq, memory_order_relaxed) != seq);
+}
+
+/**
+ * now_ms - wall clock time in milliseconds since the epoch
+ */
+static int64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((int64_t) ts.tv_sec * 1000 + ts.tv_nsec / MILLION);
+}
+
+/**
+ * mono_ms - monotonic time in milliseconds, for scheduling
+ */
+static int64_t
+mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t) ts.tv_sec * 1000 + ts.tv_nsec / MILLION);
+}
+
+/**
+ * hist_init - allocate the ring of a history metric
+ *
+ * Entries are a millisecond timestamp followed by the metric's fields
+ * as floats, padded to a power of two so that no entry straddles a
+ * cache line. The ring is allocated once and never moves.
+ */
+static void
+hist_init(gimli_hist_t *h, unsigned len)
+{
+    size_t size;
+
+    for (h->stride = 16; h->stride < sizeof (int64_t) +
+            h->nfields * sizeof (float); h->stride *= 2);
+    size = (size_t) len * h->stride;
+    size = (size + 63) & ~(size_t) 63;
+    if ((h->ring = aligned_alloc(64, size)) == NULL) {
+        printf("hist_init: out of memory\n");
+        exit(1);
+    }
+    h->len = len;
+    h->count = 0;
+}
+
+/**
+ * hist_entry - address of the i-th sample ever recorded in h
+ */
+static unsigned char *
+hist_entry(const gimli_hist_t *h, unsigned long long i)
+{
+    return (h->ring + (i % h->len) * h->stride);
+}
+
+/**
+ * hist_record - append a sample to a history metric
+ *
+ * Must be called inside a gimli_write_begin()/gimli_write_end()
+ * section; the oldest sample is overwritten once the ring is full.
+ */
+static void
+hist_record(gimli_hist_t *h, int64_t t, const float *v)
+{
+    unsigned char *e = hist_entry(h, h->count);
+
+    memcpy(e, &t, sizeof (t));
+    memcpy(e + sizeof (t), v, h->nfields * sizeof (float));
+    h->count++;
+}
+
+/**
+ * proc_read - (re)read a whole /proc file into its reusable buffer
+ *
+ * The file is opened on first use and kept open; every later call is
+ * a single pread() from offset 0, which makes the kernel regenerate the
+ * contents. The buffer grows until the whole file fits and is always
+ * NUL terminated. On failure the fd is closed so the next call starts
+ * over.
+ */
+static status_t
+proc_read(gimli_proc_t *p)
+{
+    ssize_t n;
+    size_t cap;
+    char *buf;
+
+    if (p->fd < 0 &&
+            (p->fd = open(p->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return (G_FAIL);
+    }
+    for (;;) {
+        if (p->cap == 0 || p->len + 1 >= p->cap) {
+            cap = p->cap ? p->cap * 2 : PROC_BUFSIZ;
+            if ((buf = realloc(p->buf, cap)) == NULL) return (G_FAIL);
+            p->buf = buf;
+            p->cap = cap;
+        }
+        // Retry from scratch whenever the buffer had to grow.
+        n = pread(p->fd, p->buf, p->cap - 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(p->fd);
+            p->fd = -1;
+            return (G_FAIL);
+        }
+        p->len = n;
+        if (p->len + 1 < p->cap) break;
+    }
+    p->buf[p->len] = '\0';
+    return (G_OK);
+}
+
+/**
+ * scan_u64 - parse an unsigned decimal, skipping leading blanks
+ *
+ * Returns a pointer just past the number, or NULL if there was none.
+ * Much cheaper than sscanf(): no locale, no format string, no stdio.
+ */
+static const char *
+scan_u64(const char *p, unsigned long long *val)
+{
+    unsigned long long v = 0;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p < '0' || *p > '9') return (NULL);
+    while (*p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *val = v;
+    return (p);
+}
+
+/**
+ * scan_float - parse an unsigned fixed-point decimal like 0.42
+ *
+ * Same rules as scan_u64(), the fraction is optional.
+ */
+static const char *
+scan_float(const char *p, float *val)
+{
+    unsigned long long ip, fp = 0, scale = 1;
+
+    if ((p = scan_u64(p, &ip)) == NULL) return (NULL);
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            if (scale < BILLION) {
+                fp = fp * 10 + (*p - '0');
+                scale *= 10;
+            }
+        }
+    }
+    *val = ip + (float) fp / scale;
+    return (p);
+}
+
+/**
+ * next_line - skip past the end of the current line
+ */
+static const char *
+next_line(const char *p)
+{
+    if ((p = strchr(p, '\n')) == NULL) return (NULL);
+    return (p + 1);
+}
+
+/**
+ * array_grow - make room for at least need elements of size bytes
+ *
+ * Grows by doubling, so appending one at a time stays linear.
+ */
+static status_t
+array_grow(void *arrp, unsigned *cap, unsigned need, size_t size)
+{
+    void **arr = arrp;
+    unsigned ncap = *cap ? *cap : 8;
+    void *p;
+
+    if (need <= *cap) {
+        return (G_OK);
+    }
+    while (ncap < need) ncap *= 2;
+    if ((p = realloc(*arr, (size_t) ncap * size)) == NULL) {
+        return (G_FAIL);
+    }
+    *arr = p;
+    *cap = ncap;
+    return (G_OK);
+}
+
+/*
+ * The last cpu sample, see get_cpu_util(). Only touched by the scheduler
+ * thread.
+ */
+static long double cpu_pct[CPU_NRSTATS];
+static gimli_core_t *cpu_core;
+static int cpu_cores, cpu_primed;
+
+/**
+ * cpu_diff - difference between two samples of a /proc/stat cpu line
+ *
+ * Saves the per-column deltas in diff, makes new the previous sample
+ * and returns the total number of jiffies elapsed, or 0 if old was
+ * never primed. Counters that went backwards (iowait is not monotonic)
+ * count as zero.
+ */
+static unsigned long long
+cpu_diff(gimli_cpu_t *old, const gimli_cpu_t *new,
+        unsigned long long diff[CPU_NRSTATS])
+{
+    unsigned long long tot = 0, prev = 0;
+
+    for (int k = 0; k < CPU_NRSTATS; k++) {
+        prev += old->t[k];
+        diff[k] = new->t[k] > old->t[k] ? new->t[k] - old->t[k] : 0;
+        tot += diff[k];
+    }
+    *old = *new;
+    return (prev ? tot : 0);
+}
+
+/**
+ * get_cpu_util - get total and per-core CPU util from kernel
+ *
+ * Reads all cpu lines at the top of /proc/stat in one pass: the
+ * aggregate 'cpu' line followed by one 'cpuN' line per online core.
+ * Columns 2-9 of each line are saved and utilization is calculated
+ * from the difference to the sample taken on the previous call, so
+ * the figures cover exactly one sampling interval. The percentages
+ * are published in gimli.cpu and gimli.percore by cpu_publish(). The
+ * first call only primes the previous sample.
+ *
+ * The values for columns 2-9 in /proc/stat are as follows:
+ *
+ *     user, nice, system, idle, iowait, irq, softirq, steal
+ *
+ * More info about these values can be found in proc(5).
+ *
+ */
+static status_t
+get_cpu_util(void)
+{
+    static gimli_cpu_t   old, *core_old;
+    static unsigned char *online;
+    static gimli_proc_t procstat = PROC_FILE(PROC_STAT);
+    gimli_core_t  *core = cpu_core;
+    const char    *p, *q;
+    unsigned long long val;
+    int            id, nr, ncores = cpu_cores;
+    long double    tot;
+    unsigned long long diff[CPU_NRSTATS];
+    gimli_cpu_t    new;
+
+    if (online == NULL) {
+        core_old = calloc(ncores, sizeof (*core_old));
+        online = calloc(ncores, sizeof (*online));
+        if (core_old == NULL || online == NULL) {
+            free(core_old);
+            free(online);
+            online = NULL;
+            return (G_FAIL);
+        }
+    }
+
+    if (proc_read(&procstat) != G_OK) return (G_FAIL);
+
+    // One pass over the cpu lines at the top of the file, the aggregate
+    // 'cpu' line comes first. Stop at the first line that is not a cpu.
+    memset(online, 0, ncores);
+    for (p = procstat.buf; p != NULL && strncmp(p, "cpu", 3) == 0;
+            p = next_line(p)) {
+        p += 3;
+        id = -1;
+        if (*p >= '0' && *p <= '9') {
+            if ((p = scan_u64(p, &val)) == NULL) break;
+            id = val < (unsigned long long) ncores ? (int) val : ncores;
+        }
+
+        memset(&new, 0, sizeof (new));
+        for (nr = 0; nr < CPU_NRSTATS; nr++) {
+            if ((q = scan_u64(p, &new.t[nr])) == NULL) break;
+            p = q;
+        }
+        if (nr < 4) return (G_FAIL);
+
+        if (id < 0) {
+            if ((tot = cpu_diff(&old, &new, diff)) > 0) {
+                for (int k = 0; k < CPU_NRSTATS; k++) {
+                    cpu_pct[k] = (diff[k] / tot) * 100;
+                }
+                cpu_primed = 1;
+            }
+            continue;
+        }
+        if (id >= ncores) continue;
+        online[id] = 1;
+        if ((tot = cpu_diff(&core_old[id], &new, diff)) == 0) {
+            // Just came online or no ticks yet, keep the last figures.
+            continue;
+        }
+        for (int k = 0; k < CPU_NRSTATS; k++) {
+            core[id].pct[k] = (diff[k] * 100.0f) / tot;
+        }
+    }
+
+    for (id = 0; id < ncores; id++) {
+        if (!online[id]) {
+            memset(&core_old[id], 0, sizeof (core_old[id]));
+            memset(&core[id], 0, sizeof (core[id]));
+            core[id].pct[CPU_IDLE] = -1;
+        }
+    }
+
+    return (G_OK);
+}
+
+/**
+ * cpu_publish - copy the last cpu sample into gimli
+ *
+ * All of it at once, so readers never mix two samples.
+ */
+static void
+cpu_publish(gimli_t *gimli)
+{
+    float sample[CPU_NRSTATS];
+
+    // Nothing to report until we have two samples a tick apart.
+    if (!cpu_primed) return;
+
+    for (int k = 0; k < CPU_NRSTATS; k++) {
+        sample[k] = cpu_pct[k];
+    }
+    memcpy(gimli->cpu, cpu_pct, sizeof (cpu_pct));
+    hist_record(&gimli->hist[HIST_CPU], now_ms(), sample);
+    memcpy(gimli->percore, cpu_core, cpu_cores * sizeof (*cpu_core));
+}
+
+/* The last loadavg sample. */
+static float loadavg[LOAD_NRSTATS];
+
+/**
+ * get_loadavg - sample /proc/loadavg for loadavg
+ *
+ * Save the first three values from /proc/loadavg:
+ *
+ *    1) load avg of last 1 minute
+ *    2) load avg of last 5 minutes
+ *    3) load avg of last 15 minutes
+ *
+ * More info about these values can be found in proc(5).
+ *
+ */
+static status_t
+get_loadavg(void)
+{
+    static gimli_proc_t procload = PROC_FILE(PROC_LOADAVG);
+    const char    *p;
+    float          load[LOAD_NRSTATS];
+
+    // Read first line of /proc/loadavg and get first 3 values.
+    if (proc_read(&procload) != G_OK) return (G_FAIL);
+    p = procload.buf;
+    for (int i = 0; i < LOAD_NRSTATS; i++) {
+        if ((p = scan_float(p, &load[i])) == NULL) return (G_FAIL);
+    }
+    memcpy(loadavg, load, sizeof (load));
+    return (G_OK);
+}
+
+static void
+load_publish(gimli_t *gimli)
+{
+    memcpy(gimli->load, loadavg, sizeof (loadavg));
+    hist_record(&gimli->hist[HIST_LOAD], now_ms(), loadavg);
+}
+
+/* The /proc/meminfo keys behind enum meminfo. */
+static const char *const meminfo_keys[MEM_NRSTATS] = {
+    [TOTAL_RAM]  = "MemTotal",     [FREE_RAM]   = "MemFree",
+    [SHARED_RAM] = "Shmem",        [BUFFER_RAM] = "Buffers",
+    [TOTAL_SWAP] = "SwapTotal",    [FREE_SWAP]  = "SwapFree",
+    [TOTAL_HIGH] = "HighTotal",    [FREE_HIGH]  = "HighFree",
+    [AVAIL_RAM]  = "MemAvailable", [CACHED_RAM] = "Cached",
+};
+
+/*
+ * The lines of /proc/meminfo and which of them feed enum meminfo, -1 if
+ * missing. Only touched by the scheduler thread.
+ */
+static gimli_memfield_t *memf;
+static unsigned nmemf, memfcap;
+static int memidx[MEM_NRSTATS];
+
+/* The rest of the last memory sample, see get_meminfo(). */
+static unsigned long memk[MEM_NRSTATS];
+static double memuse;
+static struct sysinfo memsys;
+
+/**
+ * meminfo_parse - parse /proc/meminfo into memf
+ *
+ * The first pass learns the key of every line and which lines feed enum
+ * meminfo. The layout never changes while the system runs, so later
+ * passes do not look at keys at all: they check that each line still
+ * has its colon where it had, and scan the value behind it. Should the
+ * check fail, the layout is learnt again.
+ */
+static status_t
+meminfo_parse(const char *buf)
+{
+    const char *line, *p;
+    gimli_memfield_t *f;
+    unsigned long long v;
+    int learn = nmemf == 0;
+    unsigned n = 0;
+    size_t len;
+
+    for (line = buf; line && *line; line = next_line(line), n++) {
+        if (learn) {
+            len = strcspn(line, ":\n");
+            if (line[len] != ':' || len >= MEMINFO_KEYSIZ ||
+                    array_grow(&memf, &memfcap, n + 1, sizeof (memf[0]))) {
+                return (G_FAIL);
+            }
+            f = &memf[n];
+            memcpy(f->name, line, len);
+            f->name[len] = '\0';
+            f->len = len;
+        } else if (n >= nmemf || strchr(line, ':') != line + memf[n].len) {
+            nmemf = 0;
+            return (meminfo_parse(buf));
+        }
+        f = &memf[n];
+        if ((p = scan_u64(line + f->len + 1, &v)) == NULL) {
+            return (G_FAIL);
+        }
+        while (*p == ' ') p++;
+        f->bytes = *p == 'k';
+        f->val = f->bytes ? v * 1024 : v;
+    }
+    if (!learn && n != nmemf) {
+        nmemf = 0;
+        return (meminfo_parse(buf));
+    }
+    if (learn) {
+        nmemf = n;
+        for (int k = 0; k < MEM_NRSTATS; k++) {
+            memidx[k] = -1;
+            for (unsigned i = 0; i < nmemf; i++) {
+                if (strcmp(memf[i].name, meminfo_keys[k]) == 0) {
+                    memidx[k] = i;
+                    break;
+                }
+            }
+        }
+    }
+    return (n > 0 ? G_OK : G_FAIL);
+}
+
+/**
+ * get_meminfo - get system memory info
+ *
+ * Memory comes from /proc/meminfo, all of it is published as is and
+ * the fields of enum meminfo are picked out of it in KiB. memuse is
+ * what is not available to new allocations without swapping, so page
+ * cache does not count as used. Process count and uptime still come
+ * from sysinfo(); see sysinfo(2) and proc(5).
+ */
+static status_t
+get_meminfo(void)
+{
+   static gimli_proc_t procmem = PROC_FILE(PROC_MEMINFO);
+   unsigned long  *mem = memk;
+
+   if (sysinfo(&memsys) < 0) {
+       return (G_FAIL);
+   }
+   if (proc_read(&procmem) != G_OK || meminfo_parse(procmem.buf) != G_OK) {
+       return (G_FAIL);
+   }
+
+   for (int k = 0; k < MEM_NRSTATS; k++) {
+       mem[k] = memidx[k] >= 0 ? memf[memidx[k]].val / 1024 : 0;
+   }
+   // Kernels before 3.14 have no MemAvailable, estimate it.
+   if (memidx[AVAIL_RAM] < 0) {
+       mem[AVAIL_RAM] = mem[FREE_RAM] + mem[BUFFER_RAM] + mem[CACHED_RAM];
+   }
+   memuse = mem[TOTAL_RAM] ?
+       100.0 * (mem[TOTAL_RAM] - mem[AVAIL_RAM]) / mem[TOTAL_RAM] : 0;
+
+   return (G_OK);
+}
+
+static void
+mem_publish(gimli_t *gimli)
+{
+   float          sample[MEM_NRSTATS], procs;
+   int64_t        now = now_ms();
+
+   for (int k = 0; k < MEM_NRSTATS; k++) {
+       sample[k] = memk[k];
+   }
+   procs = memsys.procs;
+
+   if (array_grow(&gimli->mem, &gimli->memcap, nmemf,
+               sizeof (gimli->mem[0])) == G_OK) {
+       memcpy(gimli->mem, memf, nmemf * sizeof (memf[0]));
+       gimli->nmem = nmemf;
+   }
+   memcpy(gimli->meminfo, memk, sizeof (memk));
+   gimli->memuse = memuse;
+   gimli->procs = memsys.procs;
+   gimli->uptime = memsys.uptime;
+   hist_record(&gimli->hist[HIST_MEM], now, sample);
+   hist_record(&gimli->hist[HIST_PROCS], now, &procs);
+}
+
+/**
+ * link_stats - fold a fresh set of link counters into an interface
+ *
+ * Rates are the deltas over the time since the previous dump; the
+ * first dump only primes them, as does a counter going backwards
+ * (a driver reset).
+ */
+static void
+link_stats(gimli_link_t *l, const struct rtnl_link_stats64 *st,
+        const struct timespec *now)
+{
+    unsigned long long cur[NET_NRSTATS] = {
+        [NET_RX_BYTES]   = st->rx_bytes,
+        [NET_TX_BYTES]   = st->tx_bytes,
+        [NET_RX_PACKETS] = st->rx_packets,
+        [NET_TX_PACKETS] = st->tx_packets,
+        [NET_RX_ERRORS]  = st->rx_errors,
+        [NET_TX_ERRORS]  = st->tx_errors,
+        [NET_RX_DROPPED] = st->rx_dropped,
+        [NET_TX_DROPPED] = st->tx_dropped,
+    };
+    double secs;
+
+    secs = (now->tv_sec - l->ts.tv_sec) +
+        (now->tv_nsec - l->ts.tv_nsec) / (double) BILLION;
+    for (int k = 0; k < NET_NRSTATS; k++) {
+        if (l->primed && cur[k] >= l->stat.count[k] && secs > 0) {
+            l->stat.rate[k] = (cur[k] - l->stat.count[k]) / secs;
+        } else {
+            l->stat.rate[k] = 0;
+        }
+        l->stat.count[k] = cur[k];
+    }
+    l->ts = *now;
+    l->primed = 1;
+}
+
+/*
+ * Interface table, kept up to date from rtnetlink and sorted by ifindex.
+ * Only touched by the scheduler thread.
+ */
+static gimli_link_t *links;
+static unsigned nlinks, linkcap;
+
+/**
+ * link_find - look up an interface by ifindex, optionally adding it
+ */
+static gimli_link_t *
+link_find(int ifindex, int create)
+{
+    unsigned lo = 0, hi = nlinks, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (links[mid].ifindex < ifindex) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < nlinks && links[lo].ifindex == ifindex) {
+        return (&links[lo]);
+    }
+    if (!create ||
+            array_grow(&links, &linkcap, nlinks + 1, sizeof (links[0]))) {
+        return (NULL);
+    }
+    memmove(&links[lo + 1], &links[lo], (nlinks - lo) * sizeof (links[0]));
+    memset(&links[lo], 0, sizeof (links[lo]));
+    links[lo].ifindex = ifindex;
+    nlinks++;
+    return (&links[lo]);
+}
+
+/**
+ * link_del - forget an interface and all of its addresses
+ */
+static void
+link_del(int ifindex)
+{
+    gimli_link_t *l = link_find(ifindex, 0);
+
+    if (l) {
+        free(l->addr);
+        memmove(l, l + 1, (links + nlinks - l - 1) * sizeof (links[0]));
+        nlinks--;
+    }
+}
+
+/**
+ * link_clear - forget all interfaces, before dumping them again
+ */
+static void
+link_clear(void)
+{
+    for (unsigned i = 0; i < nlinks; i++) {
+        free(links[i].addr);
+    }
+    nlinks = 0;
+}
+
+/**
+ * nl_link - apply an RTM_NEWLINK or RTM_DELLINK message
+ *
+ * Counters are only taken from dump replies, those are spaced evenly;
+ * notifications come whenever a link changes and would skew the rates.
+ */
+static void
+nl_link(const struct nlmsghdr *nh, const struct timespec *now, int stats)
+{
+    const struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    const struct rtattr *rta;
+    struct rtnl_link_stats64 st;
+    gimli_link_t *l;
+    int len = IFLA_PAYLOAD(nh);
+
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        link_del(ifi->ifi_index);
+        return;
+    }
+    if ((l = link_find(ifi->ifi_index, 1)) == NULL) {
+        return;
+    }
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            snprintf(l->ifname, sizeof (l->ifname), "%.*s",
+                    (int) RTA_PAYLOAD(rta), (char *) RTA_DATA(rta));
+        } else if (rta->rta_type == IFLA_STATS64 && stats &&
+                RTA_PAYLOAD(rta) >= sizeof (st)) {
+            // Attributes are only 4-byte aligned.
+            memcpy(&st, RTA_DATA(rta), sizeof (st));
+            link_stats(l, &st, now);
+        }
+    }
+}
+
+/**
+ * nl_addr - apply an RTM_NEWADDR or RTM_DELADDR message
+ */
+static void
+nl_addr(const struct nlmsghdr *nh)
+{
+    const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    const struct rtattr *rta;
+    const void *addr = NULL;
+    size_t alen = ifa->ifa_family == AF_INET ? 4 : 16;
+    int len = IFA_PAYLOAD(nh);
+    gimli_link_t *l;
+    gimli_addr_t *a;
+    unsigned i;
+
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+        return;
+    }
+    // On point-to-point links IFA_ADDRESS is the peer, IFA_LOCAL is ours.
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (RTA_PAYLOAD(rta) < alen) continue;
+        if (rta->rta_type == IFA_LOCAL ||
+                (rta->rta_type == IFA_ADDRESS && addr == NULL)) {
+            addr = RTA_DATA(rta);
+        }
+    }
+    if (addr == NULL) {
+        return;
+    }
+    // The link is normally known already, if not its name follows.
+    if ((l = link_find(ifa->ifa_index, nh->nlmsg_type == RTM_NEWADDR)) ==
+            NULL) {
+        return;
+    }
+    for (i = 0; i < l->naddr; i++) {
+        if (l->addr[i].family == ifa->ifa_family &&
+                memcmp(l->addr[i].addr, addr, alen) == 0) {
+            break;
+        }
+    }
+    if (nh->nlmsg_type == RTM_DELADDR) {
+        if (i < l->naddr) {
+            memmove(&l->addr[i], &l->addr[i + 1],
+                    (l->naddr - i - 1) * sizeof (l->addr[0]));
+            l->naddr--;
+        }
+    } else if (i == l->naddr && array_grow(&l->addr, &l->addrcap,
+                l->naddr + 1, sizeof (l->addr[0])) == G_OK) {
+        a = &l->addr[l->naddr++];
+        memset(a, 0, sizeof (*a));
+        a->family = ifa->ifa_family;
+        memcpy(a->addr, addr, alen);
+    }
+}
+
+/**
+ * nl_recv - read one batch of rtnetlink messages and apply them
+ *
+ * Sets *done once the dump with sequence number seq has completed.
+ * Returns 1 if a batch was read, 0 if there was none and -1 on error;
+ * ENOBUFS means notifications were dropped and the tables have to be
+ * dumped again.
+ */
+static int
+nl_recv(int fd, unsigned seq, int flags, int *done)
+{
+    static char buf[NL_BUFSIZ] __attribute__((aligned(NLMSG_ALIGNTO)));
+    const struct nlmsghdr *nh;
+    struct timespec now;
+    ssize_t n;
+    int reply;
+
+    do {
+        n = recv(fd, buf, sizeof (buf), flags);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return (errno == EAGAIN ? 0 : -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, n);
+            nh = NLMSG_NEXT(nh, n)) {
+        // Notifications may echo the seq of whoever caused them.
+        reply = seq != 0 && nh->nlmsg_seq == seq &&
+            (nh->nlmsg_flags & NLM_F_MULTI);
+        switch (nh->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            nl_link(nh, &now, reply);
+            break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            nl_addr(nh);
+            break;
+        case NLMSG_ERROR:
+            if (seq != 0 && nh->nlmsg_seq == seq) {
+                errno = -((struct nlmsgerr *) NLMSG_DATA(nh))->error;
+                return (-1);
+            }
+            break;
+        case NLMSG_DONE:
+            if (reply) *done = 1;
+            break;
+        }
+    }
+    return (1);
+}
+
+/**
+ * nl_dump - dump all links or addresses and apply them
+ */
+static status_t
+nl_dump(int fd, int type)
+{
+    static unsigned seq;
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg g;
+    } req;
+    int done = 0;
+
+    memset(&req, 0, sizeof (req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof (req.g));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = ++seq;
+    req.g.rtgen_family = AF_UNSPEC;
+    if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+        return (G_FAIL);
+    }
+    while (!done) {
+        if (nl_recv(fd, seq, 0, &done) < 0) {
+            return (G_FAIL);
+        }
+    }
+    return (G_OK);
+}
+
+/**
+ * nl_open - open an rtnetlink socket subscribed to link and address events
+ */
+static int
+nl_open(void)
+{
+    struct sockaddr_nl sa;
+    int fd, size = NL_RCVBUF;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return (-1);
+    }
+    memset(&sa, 0, sizeof (sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(fd, (struct sockaddr *) &sa, sizeof (sa)) < 0) {
+        close(fd);
+        return (-1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+    return (fd);
+}
+
+/**
+ * net_publish - copy the interface table into gimli->net
+ *
+ * The published arrays only ever grow, and are resized under the writer
+ * lock, which is also what the renderers run under.
+ */
+static void
+net_publish(gimli_t *gimli)
+{
+    unsigned i, naddr = 0;
+    gimli_net_t *n;
+
+    for (i = 0; i < nlinks; i++) {
+        naddr += links[i].naddr;
+    }
+
+    if (array_grow(&gimli->net, &gimli->netcap, nlinks,
+                sizeof (gimli->net[0])) != G_OK ||
+            array_grow(&gimli->netaddr, &gimli->netaddrcap, naddr,
+                sizeof (gimli->netaddr[0])) != G_OK) {
+        printf("net_publish: out of memory\n");
+        return;
+    }
+    naddr = 0;
+    for (i = 0; i < nlinks; i++) {
+        n = &gimli->net[i];
+        memcpy(n->ifname, links[i].ifname, sizeof (n->ifname));
+        n->stat = links[i].stat;
+        n->addr = naddr;
+        n->naddr = links[i].naddr;
+        memcpy(&gimli->netaddr[naddr], links[i].addr,
+                links[i].naddr * sizeof (links[i].addr[0]));
+        naddr += links[i].naddr;
+    }
+    gimli->netifs = nlinks;
+    gimli->netaddrs = naddr;
+}
+
+/**
+ * net_addr - format the nth address of a family of an interface
+ *
+ * Returns 0 once there are no more. Called by the renderers.
+ */
+static int
+net_addr(const gimli_net_t *n, int family, unsigned nth, char *buf,
+        size_t len)
+{
+    const gimli_addr_t *a = &gimli.netaddr[n->addr];
+    unsigned seen = 0;
+
+    for (unsigned j = 0; j < n->naddr; j++) {
+        if (a[j].family == family && seen++ == nth) {
+            inet_ntop(family, a[j].addr, buf, len);
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/**
+ * disk_is_partition - tell partitions from whole devices, via sysfs
+ */
+static int
+disk_is_partition(const char *name)
+{
+    char path[sizeof (SYS_BLOCK) + 48], *p;
+
+    snprintf(path, sizeof (path), SYS_BLOCK "/%s/partition", name);
+    // Slashes in device names, like cciss/c0d0, are ! in sysfs.
+    for (p = path + sizeof (SYS_BLOCK); *p; p++) {
+        if (*p == '/' && strcmp(p, "/partition") != 0) *p = '!';
+    }
+    return (access(path, F_OK) == 0);
+}
+
+/*
+ * Block devices as last sampled, in /proc/diskstats order. Only touched
+ * by the scheduler thread.
+ */
+static gimli_diskdev_t *dev;
+static unsigned ndev, devcap;
+
+/**
+ * get_diskstats - sample /proc/diskstats for per-device I/O rates
+ *
+ * Computes read and write IOPS, throughput, average await and
+ * utilization of every block device from the counter deltas since the
+ * previous sample. Whether a device is a partition is looked up in
+ * sysfs once, when it first shows up; partitions are left out unless
+ * --partitions was given, and so are devices that never did any I/O,
+ * like unused loop devices.
+ */
+static status_t
+get_diskstats(void)
+{
+    static gimli_proc_t diskstats = PROC_FILE(PROC_DISKSTATS);
+    unsigned long long raw[DISKF_NR], d[DISKF_NR], v;
+    struct timespec now;
+    const char *line, *p, *name;
+    gimli_diskdev_t *dv;
+    float *st;
+    unsigned i, j, n;
+    double secs;
+    size_t len;
+
+    if (proc_read(&diskstats) != G_OK) return (G_FAIL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < ndev; i++) {
+        dev[i].seen = 0;
+    }
+    for (line = diskstats.buf, n = 0; line && *line;
+            line = next_line(line), n++) {
+        // major minor name, then the counters.
+        if ((p = scan_u64(line, &v)) == NULL ||
+                (p = scan_u64(p, &v)) == NULL) {
+            continue;
+        }
+        while (*p == ' ') p++;
+        name = p;
+        len = strcspn(p, " \n");
+        p += len;
+        for (j = 0; j < DISKF_NR && (p = scan_u64(p, &raw[j])) != NULL; j++);
+        if (j < DISKF_NR || len == 0 || len >= sizeof (dv->disk.name)) {
+            continue;
+        }
+
+        // Devices keep their order, so the nth line is usually dev[n].
+        dv = n < ndev ? &dev[n] : dev;
+        if (dv == NULL || strncmp(dv->disk.name, name, len) != 0 ||
+                dv->disk.name[len] != '\0') {
+            for (dv = dev; dv < dev + ndev; dv++) {
+                if (strncmp(dv->disk.name, name, len) == 0 &&
+                        dv->disk.name[len] == '\0') {
+                    break;
+                }
+            }
+        }
+        if (dv == dev + ndev) {
+            if (array_grow(&dev, &devcap, ndev + 1, sizeof (dev[0]))) {
+                return (G_FAIL);
+            }
+            dv = &dev[ndev++];
+            memset(dv, 0, sizeof (*dv));
+            memcpy(dv->disk.name, name, len);
+            dv->part = disk_is_partition(dv->disk.name);
+        }
+
+        st = dv->disk.stat;
+        secs = dv->ts.tv_sec == 0 ? 0 : (now.tv_sec - dv->ts.tv_sec) +
+            (now.tv_nsec - dv->ts.tv_nsec) / (double) BILLION;
+        for (j = 0; j < DISKF_NR; j++) {
+            d[j] = raw[j] >= dv->raw[j] ? raw[j] - dv->raw[j] : 0;
+        }
+        if (secs > 0) {
+            st[DISK_READS] = d[DISKF_READS] / secs;
+            st[DISK_WRITES] = d[DISKF_WRITES] / secs;
+            st[DISK_READ_BYTES] = d[DISKF_READ_SECT] * DISK_SECTOR / secs;
+            st[DISK_WRITE_BYTES] = d[DISKF_WRITE_SECT] * DISK_SECTOR / secs;
+            st[DISK_READ_AWAIT] = d[DISKF_READS] ?
+                (float) d[DISKF_READ_MS] / d[DISKF_READS] : 0;
+            st[DISK_WRITE_AWAIT] = d[DISKF_WRITES] ?
+                (float) d[DISKF_WRITE_MS] / d[DISKF_WRITES] : 0;
+            st[DISK_UTIL] = d[DISKF_IO_MS] / (secs * 10);
+            if (st[DISK_UTIL] > 100) st[DISK_UTIL] = 100;
+        }
+        memcpy(dv->raw, raw, sizeof (raw));
+        dv->ts = now;
+        dv->seen = 1;
+    }
+
+    // Forget devices that went away.
+    for (i = n = 0; i < ndev; i++) {
+        if (dev[i].seen) dev[n++] = dev[i];
+    }
+    ndev = n;
+    return (G_OK);
+}
+
+static void
+disk_publish(gimli_t *gimli)
+{
+    unsigned i, n;
+
+    if (array_grow(&gimli->disk, &gimli->diskcap, ndev,
+                sizeof (gimli->disk[0])) != G_OK) {
+        return;
+    }
+    for (i = n = 0; i < ndev; i++) {
+        if ((!dev[i].part || conf.partitions) &&
+                dev[i].raw[DISKF_READS] + dev[i].raw[DISKF_WRITES] > 0) {
+            gimli->disk[n++] = dev[i].disk;
+        }
+    }
+    gimli->ndisks = n;
+}
+
+/*
+ * The statvfs() worker, and the workers that gave up on a hung mount.
+ * Only touched by the scheduler thread; fs_evfd is how a worker tells
+ * it a batch is done.
+ */
+static gimli_fsjob_t *fsjob;
+static gimli_fsjob_t *fshung[FS_MAXHUNG];
+static unsigned nfshung;
+static int fs_evfd = -1;
+
+/**
+ * fs_worker - run batches of statvfs() calls for the scheduler thread
+ *
+ * Exits after finishing a call it was abandoned in; the scheduler thread
+ * frees the job once it sees it exited.
+ */
+static void *
+fs_worker(void *arg)
+{
+    gimli_fsjob_t *job = arg;
+    gimli_fsreq_t *req;
+    struct statvfs st;
+    uint64_t one = 1;
+    int err;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (!job->abandoned && job->cur == job->nreq) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        if (job->abandoned) break;
+        req = &job->req[job->cur];
+        job->since = mono_ms();
+        pthread_mutex_unlock(&job->lock);
+
+        err = statvfs(req->path, &st) == 0 ? 0 : errno;
+
+        pthread_mutex_lock(&job->lock);
+        if (err == 0) req->st = st;
+        req->err = err;
+        if (++job->cur == job->nreq && !job->abandoned &&
+                write(fs_evfd, &one, sizeof (one)) < 0) {
+            printf("fs_worker: %s\n", strerror(errno));
+        }
+    }
+    job->exited = 1;
+    pthread_mutex_unlock(&job->lock);
+    return (NULL);
+}
+
+/**
+ * fsjob_new - start a statvfs() worker
+ */
+static gimli_fsjob_t *
+fsjob_new(void)
+{
+    gimli_fsjob_t *job;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if ((job = calloc(1, sizeof (*job))) == NULL) {
+        return (NULL);
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, fs_worker, job) != 0) {
+        pthread_cond_destroy(&job->cond);
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+        job = NULL;
+    }
+    pthread_attr_destroy(&attr);
+    return (job);
+}
+
+/**
+ * fsjob_free - free a job whose worker has exited
+ */
+static void
+fsjob_free(gimli_fsjob_t *job)
+{
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    for (unsigned i = 0; i < job->nreq; i++) {
+        free(job->req[i].path);
+    }
+    free(job->req);
+    free(job);
+}
+
+/**
+ * fs_hung - reap workers whose mount came back, and tell if path hangs
+ */
+static int
+fs_hung(const char *path)
+{
+    int hung = 0, exited;
+    unsigned i, n;
+
+    for (i = n = 0; i < nfshung; i++) {
+        pthread_mutex_lock(&fshung[i]->lock);
+        exited = fshung[i]->exited;
+        if (!exited && strcmp(fshung[i]->req[fshung[i]->cur].path, path) == 0) {
+            hung = 1;
+        }
+        pthread_mutex_unlock(&fshung[i]->lock);
+        if (exited) {
+            fsjob_free(fshung[i]);
+            continue;
+        }
+        fshung[n++] = fshung[i];
+    }
+    nfshung = n;
+    return (hung);
+}
+
+/**
+ * mountinfo_field - the next space separated field, unescaped into buf
+ *
+ * Mount points and sources have blanks and backslashes escaped as
+ * octal, like \040. Returns a pointer past the field, or NULL at the end
+ * of the line.
+ */
+static const char *
+mountinfo_field(const char *p, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    while (*p == ' ') p++;
+    if (*p == '\n' || *p == '\0') return (NULL);
+    for (; *p != ' ' && *p != '\n' && *p != '\0'; p++) {
+        char ch = *p;
+
+        if (ch == '\\' && p[1] >= '0' && p[1] <= '3' &&
+                p[2] >= '0' && p[2] <= '7' && p[3] >= '0' && p[3] <= '7') {
+            ch = (p[1] - '0') << 6 | (p[2] - '0') << 3 | (p[3] - '0');
+            p += 3;
+        }
+        if (n + 1 < len) buf[n++] = ch;
+    }
+    buf[n] = '\0';
+    return (p);
+}
+
+/*
+ * The mount table, from /proc/self/mountinfo, in its order. Only touched
+ * by the scheduler thread.
+ */
+static gimli_mount_t *mounts;
+static unsigned nmounts, mountcap;
+
+/**
+ * fs_mounts - update the mount table from mountinfo
+ *
+ * Mounts keep their last sample; a mount point that is mounted over is
+ * listed once, with what is visible there now.
+ */
+static status_t
+fs_mounts(const char *buf)
+{
+    static char path[PATH_MAX], type[FS_TYPESIZ], source[FS_PATHSIZ];
+    const char *line, *p;
+    gimli_mount_t *m;
+    unsigned i, n;
+    char field[64];
+
+    for (i = 0; i < nmounts; i++) {
+        mounts[i].seen = 0;
+    }
+    for (line = buf; line && *line; line = next_line(line)) {
+        // id parent major:minor root mount-point options [optional...] -
+        // fstype source super-options
+        p = line;
+        for (i = 0; i < 4 && p; i++) {
+            p = mountinfo_field(p, field, sizeof (field));
+        }
+        if (p == NULL || (p = mountinfo_field(p, path, sizeof (path))) ==
+                NULL) {
+            continue;
+        }
+        do {
+            p = mountinfo_field(p, field, sizeof (field));
+        } while (p && strcmp(field, "-") != 0);
+        if (p == NULL || (p = mountinfo_field(p, type, sizeof (type))) ==
+                NULL || mountinfo_field(p, source, sizeof (source)) == NULL) {
+            continue;
+        }
+
+        for (m = mounts; m < mounts + nmounts; m++) {
+            if (strcmp(m->path, path) == 0) break;
+        }
+        if (m == mounts + nmounts) {
+            if (array_grow(&mounts, &mountcap, nmounts + 1,
+                        sizeof (mounts[0])) != G_OK) {
+                return (G_FAIL);
+            }
+            m = &mounts[nmounts];
+            memset(m, 0, sizeof (*m));
+            if ((m->path = strdup(path)) == NULL) {
+                return (G_FAIL);
+            }
+            nmounts++;
+            // Published truncated, statvfs() gets the full path.
+            snprintf(m->fs.mount, sizeof (m->fs.mount), "%.*s",
+                    (int) sizeof (m->fs.mount) - 1, path);
+        }
+        snprintf(m->fs.fstype, sizeof (m->fs.fstype), "%s", type);
+        snprintf(m->fs.source, sizeof (m->fs.source), "%s", source);
+        m->seen = 1;
+    }
+
+    for (i = n = 0; i < nmounts; i++) {
+        if (mounts[i].seen) {
+            mounts[n++] = mounts[i];
+        } else {
+            free(mounts[i].path);
+        }
+    }
+    nmounts = n;
+    return (G_OK);
+}
+
+/**
+ * fs_collect - take the results of the first n requests of the job
+ *
+ * The mount table may have changed since they were posted; results for
+ * mounts that moved or went away are dropped.
+ */
+static void
+fs_collect(gimli_fsjob_t *job, unsigned n)
+{
+    const gimli_fsreq_t *req;
+    gimli_mount_t *m;
+    gimli_fs_t *fs;
+
+    for (req = job->req; req < job->req + n; req++) {
+        if (req->mount >= nmounts ||
+                strcmp(mounts[req->mount].path, req->path) != 0) {
+            continue;
+        }
+        m = &mounts[req->mount];
+        if (req->err != 0) {
+            m->valid = 0;
+            continue;
+        }
+        fs = &m->fs;
+        fs->size = (unsigned long long) req->st.f_blocks * req->st.f_frsize;
+        fs->used = (unsigned long long) (req->st.f_blocks -
+                req->st.f_bfree) * req->st.f_frsize;
+        fs->avail = (unsigned long long) req->st.f_bavail * req->st.f_frsize;
+        fs->files = req->st.f_files;
+        fs->ffree = req->st.f_ffree;
+        fs->stale = 0;
+        m->valid = req->st.f_blocks > 0;
+    }
+}
+
+/**
+ * fs_done - take the results of a batch the worker finished
+ *
+ * Called when fs_evfd fires. Returns G_FAIL if there was nothing new.
+ */
+static status_t
+fs_done(void)
+{
+    status_t ret = G_FAIL;
+
+    if (fsjob == NULL) return (G_FAIL);
+    pthread_mutex_lock(&fsjob->lock);
+    if (fsjob->cur == fsjob->nreq && !fsjob->collected) {
+        fs_collect(fsjob, fsjob->nreq);
+        fsjob->collected = 1;
+        ret = G_OK;
+    }
+    pthread_mutex_unlock(&fsjob->lock);
+    return (ret);
+}
+
+/**
+ * get_fs - have the worker sample capacity and inode usage of every mount
+ *
+ * Only posts the statvfs() calls, the scheduler thread never waits for
+ * them: the results are taken by fs_done() once the worker is through.
+ * A worker still in one call FS_TIMEOUT after it started is left behind
+ * with its mount, which is then skipped and reported stale until the
+ * call returns. Filesystems without blocks, like proc and sysfs, are
+ * left out.
+ */
+static status_t
+get_fs(void)
+{
+    gimli_fsreq_t *req;
+    gimli_mount_t *m;
+    unsigned i, n;
+
+    if (fsjob != NULL) {
+        pthread_mutex_lock(&fsjob->lock);
+        if (fsjob->cur < fsjob->nreq) {
+            if (mono_ms() - fsjob->since < FS_TIMEOUT) {
+                // Still busy with the last batch, but not stuck.
+                pthread_mutex_unlock(&fsjob->lock);
+                return (G_OK);
+            }
+            fs_collect(fsjob, fsjob->cur);
+            fsjob->abandoned = 1;
+            pthread_cond_broadcast(&fsjob->cond);
+            pthread_mutex_unlock(&fsjob->lock);
+            fshung[nfshung++] = fsjob;
+            fsjob = NULL;
+        } else {
+            pthread_mutex_unlock(&fsjob->lock);
+        }
+    }
+
+    if (nfshung == FS_MAXHUNG) {
+        for (m = mounts; m < mounts + nmounts; m++) m->fs.stale = 1;
+        return (G_OK);
+    }
+    if (fsjob == NULL && (fsjob = fsjob_new()) == NULL) return (G_FAIL);
+
+    // The worker is idle, the requests are ours until cur is reset.
+    pthread_mutex_lock(&fsjob->lock);
+    for (i = 0; i < fsjob->nreq; i++) {
+        free(fsjob->req[i].path);
+    }
+    if (array_grow(&fsjob->req, &fsjob->reqcap, nmounts,
+                sizeof (fsjob->req[0])) != G_OK) {
+        fsjob->nreq = fsjob->cur = 0;
+        pthread_mutex_unlock(&fsjob->lock);
+        return (G_FAIL);
+    }
+    for (i = n = 0; i < nmounts; i++) {
+        if (fs_hung(mounts[i].path)) {
+            mounts[i].fs.stale = 1;
+            continue;
+        }
+        req = &fsjob->req[n];
+        if ((req->path = strdup(mounts[i].path)) == NULL) break;
+        req->mount = i;
+        n++;
+    }
+    fsjob->nreq = n;
+    fsjob->cur = 0;
+    fsjob->since = mono_ms();
+    fsjob->collected = 0;
+    if (n > 0) pthread_cond_broadcast(&fsjob->cond);
+    pthread_mutex_unlock(&fsjob->lock);
+    return (G_OK);
+}
+
+static void
+fs_publish(gimli_t *gimli)
+{
+    unsigned i, n;
+
+    if (array_grow(&gimli->fs, &gimli->fscap, nmounts,
+                sizeof (gimli->fs[0])) != G_OK) {
+        return;
+    }
+    for (i = n = 0; i < nmounts; i++) {
+        if (mounts[i].valid) {
+            gimli->fs[n++] = mounts[i].fs;
+        }
+    }
+    gimli->nfs = n;
+}
+
+/* Names of the pressure resources and lines, indexed by their enums. */
+static const char *const psi_res[PSI_NR] = {
+    [PSI_CPU] = "cpu", [PSI_MEMORY] = "memory", [PSI_IO] = "io",
+};
+static const char *const psi_kinds[PSI_NRKINDS] = {
+    [PSI_SOME] = "some", [PSI_FULL] = "full",
+};
+
+/*
+ * Pressure as last sampled, with the trigger counts. Only touched by the
+ * scheduler thread.
+ */
+static gimli_psi_t psi[PSI_NR][PSI_NRKINDS];
+
+/**
+ * psi_parse - parse a pressure file into its PSI_NRKINDS lines
+ *
+ * Each line looks like "some avg10=1.15 avg60=0.71 avg300=0.63
+ * total=16224050"; cpu only has a full line on newer kernels.
+ */
+static status_t
+psi_parse(const char *buf, gimli_psi_t *lines)
+{
+    const char *line, *p;
+    gimli_psi_t *ps;
+
+    for (line = buf; line && *line; line = next_line(line)) {
+        ps = &lines[*line == 'f' ? PSI_FULL : PSI_SOME];
+        p = line;
+        for (int k = 0; k < 3; k++) {
+            if ((p = strchr(p, '=')) == NULL ||
+                    (p = scan_float(p + 1, &ps->avg[k])) == NULL) {
+                return (G_FAIL);
+            }
+        }
+        if ((p = strchr(p, '=')) == NULL ||
+                scan_u64(p + 1, &ps->total) == NULL) {
+            return (G_FAIL);
+        }
+    }
+    return (G_OK);
+}
+
+/**
+ * psi_read - sample one /proc/pressure file
+ */
+static status_t
+psi_read(enum psi_res r)
+{
+    static gimli_proc_t files[PSI_NR] = {
+        [PSI_CPU]    = PROC_FILE(PROC_PRESSURE "cpu"),
+        [PSI_MEMORY] = PROC_FILE(PROC_PRESSURE "memory"),
+        [PSI_IO]     = PROC_FILE(PROC_PRESSURE "io"),
+    };
+
+    if (proc_read(&files[r]) != G_OK) return (G_FAIL);
+    return (psi_parse(files[r].buf, psi[r]));
+}
+
+/**
+ * psi_trigger - arm a PSI trigger
+ *
+ * The kernel then wakes pollers of the fd with POLLPRI whenever tasks
+ * were stalled for stall ms within a window ms window, see
+ * Documentation/accounting/psi.rst. Without CAP_SYS_RESOURCE the window
+ * has to be a multiple of 2 s. Returns the fd or -1.
+ */
+static int
+psi_trigger(const gimli_psitrig_t *t)
+{
+    char path[64], trig[64];
+    int fd;
+
+    snprintf(path, sizeof (path), PROC_PRESSURE "%s", psi_res[t->res]);
+    snprintf(trig, sizeof (trig), "%s %u %u", psi_kinds[t->kind],
+            t->stall * 1000, t->window * 1000);
+    if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        return (-1);
+    }
+    if (write(fd, trig, strlen(trig) + 1) < 0) {
+        close(fd);
+        return (-1);
+    }
+    return (fd);
+}
+
+/**
+ * psi_publish - copy pressure into gimli
+ */
+static void
+psi_publish(gimli_t *gimli)
+{
+    memcpy(gimli->psi, psi, sizeof (psi));
+    gimli->has_psi = 1;
+}
+
+/* Keys of the flat keyed cgroup files, indexed by their enums. */
+static const char *const cg_cpu_keys[CGCPU_NRSTATS] = {
+    [CGCPU_USAGE] = "usage_usec",       [CGCPU_USER] = "user_usec",
+    [CGCPU_SYSTEM] = "system_usec",     [CGCPU_PERIODS] = "nr_periods",
+    [CGCPU_THROTTLED] = "nr_throttled",
+    [CGCPU_THROTTLED_USEC] = "throttled_usec",
+};
+static const char *const cg_mem_keys[CGMEM_NRSTATS] = {
+    [CGMEM_ANON] = "anon",       [CGMEM_FILE] = "file",
+    [CGMEM_KERNEL] = "kernel",   [CGMEM_SHMEM] = "shmem",
+    [CGMEM_SLAB] = "slab",       [CGMEM_SOCK] = "sock",
+    [CGMEM_PGFAULT] = "pgfault", [CGMEM_PGMAJFAULT] = "pgmajfault",
+};
+static const char *const cg_io_keys[CGIO_NRSTATS] = {
+    [CGIO_RBYTES] = "rbytes", [CGIO_WBYTES] = "wbytes",
+    [CGIO_RIOS] = "rios",     [CGIO_WIOS] = "wios",
+};
+
+/*
+ * The cgroup tree, sorted by inotify watch descriptor. The kernel hands
+ * those out in increasing order, so parents come before their children.
+ * Only touched by the scheduler thread.
+ */
+static gimli_cgnode_t *cgnodes;
+static unsigned ncgnodes, cgnodecap;
+static char cgmount[PATH_MAX];
+static int cgifd = -1;
+
+/**
+ * cg_mount - find where the cgroup2 hierarchy is mounted
+ *
+ * Usually /sys/fs/cgroup, or /sys/fs/cgroup/unified on hybrid systems
+ * that still have the v1 controllers there.
+ */
+static status_t
+cg_mount(void)
+{
+    static gimli_proc_t mountinfo = PROC_FILE(PROC_MOUNTINFO);
+    static char path[PATH_MAX];
+    const char *line, *p;
+    char field[64];
+
+    if (proc_read(&mountinfo) != G_OK) return (G_FAIL);
+    for (line = mountinfo.buf; line && *line; line = next_line(line)) {
+        p = line;
+        for (int i = 0; i < 4 && p; i++) {
+            p = mountinfo_field(p, field, sizeof (field));
+        }
+        if (p == NULL || (p = mountinfo_field(p, path, sizeof (path))) ==
+                NULL) {
+            continue;
+        }
+        do {
+            p = mountinfo_field(p, field, sizeof (field));
+        } while (p && strcmp(field, "-") != 0);
+        if (p && mountinfo_field(p, field, sizeof (field)) &&
+                strcmp(field, "cgroup2") == 0) {
+            memcpy(cgmount, path, sizeof (cgmount));
+            return (G_OK);
+        }
+    }
+    return (G_FAIL);
+}
+
+/**
+ * cg_find - look up a cgroup by watch descriptor, optionally adding it
+ */
+static gimli_cgnode_t *
+cg_find(int wd, int create)
+{
+    unsigned lo = 0, hi = ncgnodes, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cgnodes[mid].wd < wd) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < ncgnodes && cgnodes[lo].wd == wd) {
+        return (&cgnodes[lo]);
+    }
+    if (!create || array_grow(&cgnodes, &cgnodecap, ncgnodes + 1,
+                sizeof (cgnodes[0]))) {
+        return (NULL);
+    }
+    memmove(&cgnodes[lo + 1], &cgnodes[lo],
+            (ncgnodes - lo) * sizeof (cgnodes[0]));
+    memset(&cgnodes[lo], 0, sizeof (cgnodes[lo]));
+    cgnodes[lo].wd = wd;
+    cgnodes[lo].fd = -1;
+    ncgnodes++;
+    return (&cgnodes[lo]);
+}
+
+/**
+ * cg_add - start watching a cgroup, and every cgroup below it
+ *
+ * pfd and ppath are the directory fd and path of the parent; a NULL
+ * name adds the root. The watch is set up before the directory is
+ * listed, so a child made in between shows up once as an event, once
+ * in the listing, or both; a cgroup already watched is left alone.
+ */
+static status_t
+cg_add(int pfd, const char *ppath, const char *name)
+{
+    char full[PATH_MAX], *path;
+    gimli_cgnode_t *n;
+    struct dirent *de;
+    DIR *dir;
+    int fd, dfd, wd;
+
+    if (name == NULL) {
+        path = strdup("");
+        fd = open(cgmount, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        if (asprintf(&path, "%s/%s", ppath, name) < 0) path = NULL;
+        fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (path == NULL || fd < 0) {
+        if (fd >= 0) close(fd);
+        free(path);
+        return (G_FAIL);
+    }
+    snprintf(full, sizeof (full), "%s%s", cgmount, path);
+    if ((wd = inotify_add_watch(cgifd, full, IN_CREATE | IN_DELETE |
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)) < 0 ||
+            (n = cg_find(wd, 1)) == NULL || n->path != NULL) {
+        close(fd);
+        free(path);
+        return (wd < 0 || n == NULL ? G_FAIL : G_OK);
+    }
+    n->fd = fd;
+    n->path = path;
+    snprintf(n->cg.path, sizeof (n->cg.path), "%.*s",
+            (int) sizeof (n->cg.path) - 1, *path ? path : "/");
+
+    // The fd is only for openat(), listing goes through its own.
+    if ((dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return (G_FAIL);
+    }
+    if ((dir = fdopendir(dfd)) == NULL) {
+        close(dfd);
+        return (G_FAIL);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 ||
+                strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (cg_add(fd, path, de->d_name) != G_OK && errno != ENOENT) {
+            printf("cg_add %s/%s: %s\n", path, de->d_name, strerror(errno));
+        }
+    }
+    closedir(dir);
+    return (G_OK);
+}
+
+/**
+ * cg_del - stop watching a cgroup
+ */
+static void
+cg_del(int wd)
+{
+    gimli_cgnode_t *n = cg_find(wd, 0);
+
+    if (n) {
+        inotify_rm_watch(cgifd, wd);
+        close(n->fd);
+        free(n->path);
+        memmove(n, n + 1, (cgnodes + ncgnodes - n - 1) * sizeof (cgnodes[0]));
+        ncgnodes--;
+    }
+}
+
+/**
+ * cg_sync - forget the tree and walk it again, with a fresh inotify fd
+ */
+static status_t
+cg_sync(void)
+{
+    for (unsigned i = 0; i < ncgnodes; i++) {
+        close(cgnodes[i].fd);
+        free(cgnodes[i].path);
+    }
+    ncgnodes = 0;
+    if (cgifd >= 0) close(cgifd);
+    if ((cgifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        return (G_FAIL);
+    }
+    return (cg_add(-1, NULL, NULL));
+}
+
+/**
+ * cg_events - apply what inotify saw happen to the tree
+ *
+ * New directories are walked, removed ones dropped. Removals are taken
+ * from the parent: the directory fd keeps a removed cgroup's inode, and
+ * so its own watch, alive. A rename moves a whole subtree and an
+ * overflowed queue lost events, so for those this returns G_FAIL and the
+ * tree has to be walked again.
+ */
+static status_t
+cg_events(void)
+{
+    static char buf[CG_EVBUFSIZ]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    const char *path;
+    char child[PATH_MAX];
+    gimli_cgnode_t *n;
+    status_t ret = G_OK;
+    ssize_t len;
+
+    while ((len = read(cgifd, buf, sizeof (buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof (*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_MOVED_FROM | IN_MOVED_TO)) {
+                ret = G_FAIL;
+            } else if (ev->mask & IN_IGNORED) {
+                cg_del(ev->wd);
+            } else if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) &&
+                    (n = cg_find(ev->wd, 0)) != NULL) {
+                // Adding may move n, but not the path it points to.
+                path = n->path;
+                if (cg_add(n->fd, path, ev->name) != G_OK &&
+                        errno != ENOENT) {
+                    printf("cg_add %s/%s: %s\n", path, ev->name,
+                            strerror(errno));
+                }
+            } else if ((ev->mask & IN_DELETE) && (ev->mask & IN_ISDIR) &&
+                    (n = cg_find(ev->wd, 0)) != NULL) {
+                snprintf(child, sizeof (child), "%s/%s", n->path, ev->name);
+                for (n = cgnodes; n < cgnodes + ncgnodes; n++) {
+                    if (strcmp(n->path, child) == 0) {
+                        cg_del(n->wd);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return (ret);
+}
+
+/**
+ * cg_file - read a file of a cgroup, NUL terminated
+ *
+ * Returns a static buffer, or NULL if the file is not there, like
+ * memory.stat when the memory controller is not enabled.
+ */
+static const char *
+cg_file(int dirfd, const char *name)
+{
+    static char buf[CG_BUFSIZ];
+    ssize_t n;
+    int fd;
+
+    if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) < 0) return (NULL);
+    n = read(fd, buf, sizeof (buf) - 1);
+    close(fd);
+    if (n < 0) return (NULL);
+    buf[n] = '\0';
+    return (buf);
+}
+
+/**
+ * cg_keys - pick the values of keys out of a flat keyed file
+ *
+ * Lines look like "usage_usec 1234"; other keys are skipped, and
+ * missing ones, like kernel on older kernels, are left alone.
+ */
+static void
+cg_keys(const char *buf, const char *const *keys, unsigned nkeys,
+        unsigned long long *val)
+{
+    const char *line;
+    size_t len;
+
+    for (line = buf; line && *line; line = next_line(line)) {
+        len = strcspn(line, " \n");
+        for (unsigned i = 0; i < nkeys; i++) {
+            if (strncmp(line, keys[i], len) == 0 && keys[i][len] == '\0') {
+                scan_u64(line + len, &val[i]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * cg_io - sum the counters of every device in io.stat
+ *
+ * Lines look like "8:0 rbytes=90112 wbytes=0 rios=7 wios=0 dbytes=0
+ * dios=0".
+ */
+static void
+cg_io(const char *buf, unsigned long long *val)
+{
+    const char *line, *p, *key;
+    unsigned long long v;
+    size_t len;
+
+    memset(val, 0, CGIO_NRSTATS * sizeof (val[0]));
+    for (line = buf; line && *line; line = next_line(line)) {
+        for (p = line + strcspn(line, " \n"); *p == ' '; ) {
+            key = ++p;
+            len = strcspn(key, "= \n");
+            p = key + len;
+            if (*p != '=') break;
+            for (unsigned i = 0; i < CGIO_NRSTATS; i++) {
+                if (strncmp(key, cg_io_keys[i], len) == 0 &&
+                        cg_io_keys[i][len] == '\0' &&
+                        scan_u64(p + 1, &v) != NULL) {
+                    val[i] += v;
+                    break;
+                }
+            }
+            p += strcspn(p, " \n");
+        }
+    }
+}
+
+/**
+ * cg_read - sample the files of one cgroup
+ *
+ * Rates are only taken between two samples that both had the file;
+ * a counter that went backwards, like io.stat when a device went away,
+ * counts as zero.
+ */
+static void
+cg_read(gimli_cgnode_t *n, int64_t now)
+{
+    gimli_cgroup_t *cg = &n->cg;
+    unsigned long long usage = cg->cpu[CGCPU_USAGE], io[CGIO_NRSTATS];
+    double secs = n->ts && now > n->ts ? (now - n->ts) / 1000.0 : 0;
+    unsigned had = cg->has;
+    const char *buf;
+    char name[32];
+    int r;
+
+    cg->has = 0;
+    if ((buf = cg_file(n->fd, "cpu.stat")) != NULL) {
+        cg_keys(buf, cg_cpu_keys, CGCPU_NRSTATS, cg->cpu);
+        cg->cpu_pct = secs && (had & CG_HAS_CPU) &&
+            cg->cpu[CGCPU_USAGE] >= usage ?
+            (cg->cpu[CGCPU_USAGE] - usage) / (secs * 10000) : 0;
+        cg->has |= CG_HAS_CPU;
+    }
+    if ((buf = cg_file(n->fd, "memory.current")) != NULL &&
+            scan_u64(buf, &cg->mem_current) != NULL &&
+            (buf = cg_file(n->fd, "memory.stat")) != NULL) {
+        cg_keys(buf, cg_mem_keys, CGMEM_NRSTATS, cg->mem);
+        cg->has |= CG_HAS_MEM;
+    }
+    if ((buf = cg_file(n->fd, "io.stat")) != NULL) {
+        memcpy(io, cg->io, sizeof (io));
+        cg_io(buf, cg->io);
+        for (int k = 0; k < CGIO_NRSTATS; k++) {
+            cg->io_rate[k] = secs && (had & CG_HAS_IO) &&
+                cg->io[k] >= io[k] ? (cg->io[k] - io[k]) / secs : 0;
+        }
+        cg->has |= CG_HAS_IO;
+    }
+    for (r = 0; r < PSI_NR; r++) {
+        snprintf(name, sizeof (name), "%s.pressure", psi_res[r]);
+        if ((buf = cg_file(n->fd, name)) == NULL ||
+                psi_parse(buf, cg->psi[r]) != G_OK) {
+            break;
+        }
+    }
+    if (r == PSI_NR) cg->has |= CG_HAS_PSI;
+    n->ts = now;
+}
+
+/**
+ * get_cgroups - sample every cgroup
+ */
+static status_t
+get_cgroups(void)
+{
+    int64_t now = mono_ms();
+
+    for (unsigned i = 0; i < ncgnodes; i++) {
+        cg_read(&cgnodes[i], now);
+    }
+    return (G_OK);
+}
+
+static void
+cg_publish(gimli_t *gimli)
+{
+    if (array_grow(&gimli->cgroup, &gimli->cgcap, ncgnodes,
+                sizeof (gimli->cgroup[0])) != G_OK) {
+        return;
+    }
+    for (unsigned i = 0; i < ncgnodes; i++) {
+        gimli->cgroup[i] = cgnodes[i].cg;
+    }
+    gimli->ncgroups = ncgnodes;
+}
+
+/*
+ * The process table, an open addressing hash table by pid with linear
+ * probing. Only touched by the scheduler thread.
+ */
+static gimli_task_t *tasks;
+static unsigned taskcap, ntasks, ntaskdel;
+
+/* The busiest processes of the last sample, sorted, see get_top(). */
+static gimli_task_t *topheap[TOP_NRKEYS][TOP_MAX];
+static unsigned ntopheap[TOP_NRKEYS];
+
+static DIR *procdir;
+static long clk_tck, page_size;
+
+/**
+ * task_slot - the slot of pid, or where it would go
+ */
+static gimli_task_t *
+task_slot(gimli_task_t *tab, unsigned cap, int pid)
+{
+    gimli_task_t *del = NULL, *t;
+    unsigned i = (pid * 2654435761u) & (cap - 1);
+
+    for (;; i = (i + 1) & (cap - 1)) {
+        t = &tab[i];
+        if (t->pid == pid) return (t);
+        if (t->pid == 0) return (del ? del : t);
+        if (t->pid < 0 && del == NULL) del = t;
+    }
+}
+
+/**
+ * task_get - look up a process, adding it if it is new
+ *
+ * Keeps the table at most half full, deleted slots included; growing or
+ * rehashing drops the deleted ones.
+ */
+static gimli_task_t *
+task_get(int pid)
+{
+    gimli_task_t *tab, *t;
+    unsigned cap;
+
+    if (taskcap && (t = task_slot(tasks, taskcap, pid))->pid == pid) {
+        return (t);
+    }
+    if ((ntasks + ntaskdel + 1) * 2 > taskcap) {
+        cap = taskcap ? taskcap : 1024;
+        while ((ntasks + 1) * 2 > cap / 2) cap *= 2;
+        if ((tab = calloc(cap, sizeof (*tab))) == NULL) {
+            return (NULL);
+        }
+        for (unsigned i = 0; i < taskcap; i++) {
+            if (tasks[i].pid > 0) {
+                *task_slot(tab, cap, tasks[i].pid) = tasks[i];
+            }
+        }
+        free(tasks);
+        tasks = tab;
+        taskcap = cap;
+        ntaskdel = 0;
+    }
+    t = task_slot(tasks, taskcap, pid);
+    if (t->pid < 0) ntaskdel--;
+    memset(t, 0, sizeof (*t));
+    t->pid = pid;
+    ntasks++;
+    return (t);
+}
+
+/**
+ * task_read - sample /proc/[pid]/stat into a process
+ *
+ * The command may hold blanks and parentheses, so the fields are found
+ * after the last ')'. See proc(5) for the field numbers.
+ */
+static status_t
+task_read(int procfd, gimli_task_t *t, int64_t now, long hz, long page)
+{
+    unsigned long long utime = 0, stime = 0, start = 0, rss = 0, v;
+    char path[32], buf[1024];
+    const char *p, *comm;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof (path), "%d/stat", t->pid);
+    if ((fd = openat(procfd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return (G_FAIL);
+    }
+    n = read(fd, buf, sizeof (buf) - 1);
+    close(fd);
+    if (n <= 0) return (G_FAIL);
+    buf[n] = '\0';
+    if ((comm = strchr(buf, '(')) == NULL || (p = strrchr(buf, ')')) == NULL) {
+        return (G_FAIL);
+    }
+
+    // Field 3 is the state, then numbers; some of them may be negative.
+    p += 3;
+    for (int f = 4; f <= 24; f++) {
+        while (*p == ' ') p++;
+        if (f == 14 || f == 15 || f == 22 || f == 24) {
+            if ((p = scan_u64(p, &v)) == NULL) return (G_FAIL);
+            if (f == 14) utime = v;
+            if (f == 15) stime = v;
+            if (f == 22) start = v;
+            if (f == 24) rss = v * page;
+        } else {
+            p += strcspn(p, " ");
+        }
+    }
+
+    // The command changes on exec, so take it every time.
+    snprintf(t->comm, sizeof (t->comm), "%.*s",
+            (int) (strrchr(buf, ')') - comm - 1), comm + 1);
+    if (t->ts == 0 || t->start != start) {
+        // New, or a new process under a reused pid.
+        t->cpu = 0;
+        t->rss_delta = 0;
+        t->start = start;
+    } else if (now > t->ts) {
+        t->cpu = (utime + stime - t->ticks) * 100.0 * 1000 /
+            ((double) hz * (now - t->ts));
+        t->rss_delta = (long long) rss - (long long) t->rss;
+    }
+    t->ticks = utime + stime;
+    t->rss = rss;
+    t->ts = now;
+    return (G_OK);
+}
+
+/**
+ * task_key - the value a top is sorted by
+ */
+static double
+task_key(const gimli_task_t *t, enum top_key key)
+{
+    return (key == TOP_CPU ? t->cpu : t->rss);
+}
+
+/**
+ * top_push - offer a process to a bounded min-heap of the top ones
+ *
+ * The heap holds at most TOP_MAX processes with the smallest on top, so
+ * each offer is a compare and, for the few that make it, O(log TOP_MAX).
+ */
+static void
+top_push(gimli_task_t **heap, unsigned *n, gimli_task_t *t, enum top_key key)
+{
+    unsigned i, c;
+
+    if (*n == TOP_MAX) {
+        if (task_key(t, key) <= task_key(heap[0], key)) return;
+        // Replace the smallest and sift it down.
+        for (i = 0; (c = 2 * i + 1) < TOP_MAX; i = c) {
+            if (c + 1 < TOP_MAX &&
+                    task_key(heap[c + 1], key) < task_key(heap[c], key)) {
+                c++;
+            }
+            if (task_key(heap[c], key) >= task_key(t, key)) break;
+            heap[i] = heap[c];
+        }
+        heap[i] = t;
+        return;
+    }
+    for (i = (*n)++; i > 0 && task_key(heap[(i - 1) / 2], key) >
+            task_key(t, key); i = (i - 1) / 2) {
+        heap[i] = heap[(i - 1) / 2];
+    }
+    heap[i] = t;
+}
+
+/**
+ * task_cmp - qsort_r() order for a top, largest first
+ */
+static int
+task_cmp(const void *a, const void *b, void *key)
+{
+    double ka = task_key(*(gimli_task_t *const *) a, *(enum top_key *) key);
+    double kb = task_key(*(gimli_task_t *const *) b, *(enum top_key *) key);
+
+    return (ka < kb) - (ka > kb);
+}
+
+/**
+ * get_top - sample processes and pick the busiest ones
+ *
+ * Every interval lists /proc, which is cheap, but reads at most
+ * TOP_BUDGET stat files, continuing round-robin where the previous
+ * interval stopped; on huge hosts each process is then sampled every
+ * few intervals, its cpu percentage taken over its own elapsed time.
+ */
+static status_t
+get_top(void)
+{
+    static int *pids;
+    static unsigned pidcap, gen, rr;
+    unsigned npids = 0, i;
+    DIR *dir = procdir;
+    struct dirent *de;
+    gimli_task_t *t;
+    int64_t now;
+    char *end;
+    long pid;
+
+    gen++;
+    rewinddir(dir);
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] < '1' || de->d_name[0] > '9') continue;
+        pid = strtol(de->d_name, &end, 10);
+        if (*end != '\0' || (t = task_get(pid)) == NULL) continue;
+        t->gen = gen;
+        if (array_grow(&pids, &pidcap, npids + 1, sizeof (pids[0]))) {
+            return (G_FAIL);
+        }
+        pids[npids++] = pid;
+    }
+
+    now = mono_ms();
+    for (i = 0; i < npids && i < TOP_BUDGET; i++) {
+        t = task_get(pids[(rr + i) % npids]);
+        if (task_read(dirfd(dir), t, now, clk_tck, page_size) != G_OK) {
+            t->gen = 0;
+        }
+    }
+    rr = npids ? (rr + i) % npids : 0;
+
+    memset(ntopheap, 0, sizeof (ntopheap));
+    for (i = 0; i < taskcap; i++) {
+        t = &tasks[i];
+        if (t->pid <= 0) continue;
+        if (t->gen != gen) {
+            // Gone.
+            t->pid = -1;
+            ntasks--;
+            ntaskdel++;
+            continue;
+        }
+        if (t->ts == 0) continue;
+        for (int k = 0; k < TOP_NRKEYS; k++) {
+            top_push(topheap[k], &ntopheap[k], t, k);
+        }
+    }
+
+    for (enum top_key k = 0; k < TOP_NRKEYS; k++) {
+        qsort_r(topheap[k], ntopheap[k], sizeof (topheap[k][0]),
+                task_cmp, &k);
+    }
+    return (G_OK);
+}
+
+static void
+top_publish(gimli_t *gimli)
+{
+    gimli_task_t *t;
+
+    for (int k = 0; k < TOP_NRKEYS; k++) {
+        for (unsigned i = 0; i < ntopheap[k]; i++) {
+            t = topheap[k][i];
+            gimli->top[k][i].pid = t->pid;
+            memcpy(gimli->top[k][i].comm, t->comm, TOP_COMMSIZ);
+            gimli->top[k][i].cpu = t->cpu;
+            gimli->top[k][i].rss = t->rss;
+            gimli->top[k][i].rss_delta = t->rss_delta;
+        }
+    }
+    gimli->ntop = ntopheap[TOP_CPU];
+    gimli->ntasks = ntasks;
+}
+
+static void *
+thread_create_detached(void *(*func) (void *), void *arg)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&tid, &attr, func, arg);
+    return (void *) {0};
+}
+
+/**
+ * str_printf - append formatted output to a growable string
+ *
+ * The buffer grows as needed and stays NUL terminated. If memory runs
+ * out the output is truncated rather than lost.
+ */
+static void
+str_printf(gimli_str_t *s, const char *fmt, ...)
+{
+    va_list ap;
+    size_t cap;
+    char *buf;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(s->buf + s->len, s->cap - s->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (s->len + n < s->cap) {
+            s->len += n;
+            return;
+        }
+        for (cap = s->cap ? s->cap : 256; cap <= s->len + n; cap *= 2);
+        if ((buf = realloc(s->buf, cap)) == NULL) {
+            s->len = s->cap ? s->cap - 1 : 0;
+            return;
+        }
+        s->buf = buf;
+        s->cap = cap;
+    }
+}
+
+/**
+ * buf_alloc - allocate a refcounted buffer of len bytes
+ *
+ * The caller owns the only reference and fills in data, after which
+ * the buffer must be treated as immutable. Returns NULL if out of
+ * memory.
+ */
+static gimli_buf_t *
+buf_alloc(size_t len)
+{
+    gimli_buf_t *b;
+
+    if ((b = malloc(sizeof (*b) + len)) == NULL) return (NULL);
+    atomic_init(&b->refs, 1);
+    b->len = len;
+    return (b);
+}
+
+/**
+ * http_reason - reason phrase for the status codes we answer with
+ */
+static const char *
+http_reason(int status)
+{
+    switch (status) {
+    case 200: return ("OK");
+    case 400: return ("Bad Request");
+    case 403: return ("Forbidden");
+    case 404: return ("Not Found");
+    case 405: return ("Method Not Allowed");
+    case 414: return ("URI Too Long");
+    case 426: return ("Upgrade Required");
+    case 431: return ("Request Header Fields Too Large");
+    case 501: return ("Not Implemented");
+    case 503: return ("Service Unavailable");
+    case 505: return ("HTTP Version Not Supported");
+    default:  return ("Error");
+    }
+}
+
+/**
+ * resp_new - make a complete HTTP response around a JSON body
+ *
+ * Headers and body end up in one buffer so a response is always a
+ * single contiguous write. Returns NULL if out of memory.
+ */
+static gimli_buf_t *
+resp_new(int status, const char *type, const char *body, size_t len)
+{
+    char hdr[256];
+    gimli_buf_t *b;
+    int n;
+
+    n = snprintf(hdr, sizeof (hdr), HTTP_HDR, status, http_reason(status),
+            type, len);
+    if ((b = buf_alloc(n + len)) == NULL) return (NULL);
+    memcpy(b->data, hdr, n);
+    memcpy(b->data + n, body, len);
+    return (b);
+}
+
+/**
+ * resp_error - make an error response for status
+ */
+static gimli_buf_t *
+resp_error(int status)
+{
+    static const char body[] = "{\"err\": 1}\r\n";
+
+    return (resp_new(status, HTTP_JSON, body, sizeof (body) - 1));
+}
+
+static gimli_buf_t *
+buf_ref(gimli_buf_t *b)
+{
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    return (b);
+}
+
+static void
+buf_unref(gimli_buf_t *b)
+{
+    if (b != NULL &&
+            atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+        free(b);
+    }
+}
+
+/*
+ * Renderers for the cached responses. They run in gimli_write_end()
+ * with the writer lock held, so they read gimli directly: nothing can
+ * change underneath them.
+ */
+
+static void
+render_cpu(gimli_str_t *out)
+{
+    str_printf(out,
+            "{" \
+                "\"cpu\":{" \
+                    "\"us\":%.1Lf," \
+                    "\"sy\":%.1Lf," \
+                    "\"id\":%.1Lf," \
+                    "\"wa\":%.1Lf," \
+                    "\"ni\":%.1Lf," \
+                    "\"hi\":%.1Lf," \
+                    "\"si\":%.1Lf," \
+                    "\"st\":%.1Lf" \
+                "}" \
+            "}\r\n",
+            gimli.cpu[CPU_USER], gimli.cpu[CPU_SYSTEM],
+            gimli.cpu[CPU_IDLE], gimli.cpu[CPU_IOWAIT],
+            gimli.cpu[CPU_NICE], gimli.cpu[CPU_IRQ],
+            gimli.cpu[CPU_SOFTIRQ], gimli.cpu[CPU_STEAL]);
+}
+
+/* Cores missing from the last sample (offline) are left out. */
+static void
+render_cpu_cores(gimli_str_t *out)
+{
+    const gimli_core_t *c;
+    int n = 0;
+
+    str_printf(out, "{\"cores\":[");
+    for (int i = 0; gimli.percore != NULL && i < gimli.cores; i++) {
+        c = &gimli.percore[i];
+        if (c->pct[CPU_IDLE] < 0) continue;
+        str_printf(out,
+                "%s{" \
+                    "\"cpu\":%d," \
+                    "\"us\":%.1f," \
+                    "\"sy\":%.1f," \
+                    "\"id\":%.1f," \
+                    "\"wa\":%.1f," \
+                    "\"ni\":%.1f," \
+                    "\"hi\":%.1f," \
+                    "\"si\":%.1f," \
+                    "\"st\":%.1f" \
+                "}",
+                n++ ? "," : "", i,
+                c->pct[CPU_USER], c->pct[CPU_SYSTEM],
+                c->pct[CPU_IDLE], c->pct[CPU_IOWAIT],
+                c->pct[CPU_NICE], c->pct[CPU_IRQ],
+                c->pct[CPU_SOFTIRQ], c->pct[CPU_STEAL]);
+    }
+    str_printf(out, "]}\r\n");
+}
+
+static void
+render_load(gimli_str_t *out)
+{
+    str_printf(out,
+            "{" \
+                "\"load\":[%.2f, %.2f, %.2f]" \
+            "}\r\n",
+            gimli.load[LOAD_ONE], gimli.load[LOAD_FIVE],
+            gimli.load[LOAD_FIFTEEN]);
+}
+
+static void
+render_uptime(gimli_str_t *out)
+{
+    str_printf(out,
+            "{" \
+                "\"uptime\":[%lu, %01lu, %02lu]" \
+            "}\r\n",
+            gimli.uptime/86400, gimli.uptime/3600%24, gimli.uptime/60%60);
+}
+
+static void
+render_procs(gimli_str_t *out)
+{
+    str_printf(out,
+            "{" \
+                "\"procs\":%hu" \
+            "}\r\n",
+            gimli.procs);
+}
+
+static void
+render_cores(gimli_str_t *out)
+{
+    str_printf(out,
+            "{" \
+                "\"cores\":%d" \
+            "}\r\n",
+            gimli.cores);
+}
+
+/* Names of the link counters, indexed by enum net_stat. */
+static const char *const net_stats[NET_NRSTATS] = {
+    [NET_RX_BYTES]   = "rx_bytes",
+    [NET_TX_BYTES]   = "tx_bytes",
+    [NET_RX_PACKETS] = "rx_packets",
+    [NET_TX_PACKETS] = "tx_packets",
+    [NET_RX_ERRORS]  = "rx_errors",
+    [NET_TX_ERRORS]  = "tx_errors",
+    [NET_RX_DROPPED] = "rx_dropped",
+    [NET_TX_DROPPED] = "tx_dropped",
+};
+
+/* Names of the per-device disk rates, indexed by enum disk_stat. */
+static const struct {
+    const char *json;
+    const char *prom;
+    const char *help;
+} disk_stats[DISK_NRSTATS] = {
+    [DISK_READS]       = { "reads", "gimli_disk_reads_per_second",
+                           "Reads completed per second." },
+    [DISK_WRITES]      = { "writes", "gimli_disk_writes_per_second",
+                           "Writes completed per second." },
+    [DISK_READ_BYTES]  = { "read_bytes", "gimli_disk_read_bytes_per_second",
+                           "Bytes read per second." },
+    [DISK_WRITE_BYTES] = { "write_bytes",
+                           "gimli_disk_written_bytes_per_second",
+                           "Bytes written per second." },
+    [DISK_READ_AWAIT]  = { "read_await", "gimli_disk_read_await_ms",
+                           "Average time per read, in milliseconds." },
+    [DISK_WRITE_AWAIT] = { "write_await", "gimli_disk_write_await_ms",
+                           "Average time per write, in milliseconds." },
+    [DISK_UTIL]        = { "util", "gimli_disk_utilization_percent",
+                           "Time the device was busy, in percent." },
+};
+
+/**
+ * json_str - append a string as a JSON string literal, escaped
+ */
+static void
+json_str(gimli_str_t *out, const char *s)
+{
+    str_printf(out, "\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            str_printf(out, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            str_printf(out, "\\u%04x", *s);
+        } else {
+            str_printf(out, "%c", *s);
+        }
+    }
+    str_printf(out, "\"");
+}
+
+/**
+ * render_addrs - append the addresses of one family as a JSON array
+ */
+static void
+render_addrs(gimli_str_t *out, const gimli_net_t *n, int family)
+{
+    char ip[INET6_ADDRSTRLEN];
+
+    str_printf(out, "[");
+    for (unsigned j = 0; net_addr(n, family, j, ip, sizeof (ip)); j++) {
+        str_printf(out, "%s\"%s\"", j ? "," : "", ip);
+    }
+    str_printf(out, "]");
+}
+
+/**
+ * render_ipv4 - append the first IPv4 address of an interface, or ""
+ *
+ * "ipv4" has always been a single string; the full list is "ipv4s".
+ */
+static void
+render_ipv4(gimli_str_t *out, const gimli_net_t *n)
+{
+    char ip[INET6_ADDRSTRLEN];
+
+    if (!net_addr(n, AF_INET, 0, ip, sizeof (ip))) ip[0] = '\0';
+    str_printf(out, "\"%s\"", ip);
+}
+
+/*
+ * One object per interface with an address. Counters are totals since boot, rates are
+ * per second.
+ */
+static void
+render_net(gimli_str_t *out)
+{
+    const gimli_netstat_t *st;
+    int first = 1;
+
+    str_printf(out, "{\"netifs\":[");
+    for (unsigned i = 0; i < gimli.netifs; i++) {
+        if (gimli.net[i].naddr == 0) continue;
+        st = &gimli.net[i].stat;
+        str_printf(out, "%s{\"ifname\":", first ? "" : ",");
+        json_str(out, gimli.net[i].ifname);
+        str_printf(out, ",\"ipv4\":");
+        render_ipv4(out, &gimli.net[i]);
+        str_printf(out, ",\"ipv4s\":");
+        render_addrs(out, &gimli.net[i], AF_INET);
+        str_printf(out, ",\"ipv6\":");
+        render_addrs(out, &gimli.net[i], AF_INET6);
+        str_printf(out, ",\"stats\":{");
+        for (int k = 0; k < NET_NRSTATS; k++) {
+            str_printf(out, "%s\"%s\":%llu", k ? "," : "",
+                    net_stats[k], st->count[k]);
+        }
+        str_printf(out, "},\"rates\":{");
+        for (int k = 0; k < NET_NRSTATS; k++) {
+            str_printf(out, "%s\"%s\":%.1f", k ? "," : "",
+                    net_stats[k], st->rate[k]);
+        }
+        str_printf(out, "}}");
+        first = 0;
+    }
+    str_printf(out, "]}\r\n");
+}
+
+/* Every /proc/meminfo field, kB ones in bytes, and usage in percent. */
+static void
+render_meminfo(gimli_str_t *out)
+{
+    str_printf(out, "{\"meminfo\":{");
+    for (unsigned i = 0; i < gimli.nmem; i++) {
+        str_printf(out, "%s\"%s\":%llu", i ? "," : "", gimli.mem[i].name,
+                gimli.mem[i].val);
+    }
+    str_printf(out, "},\"available_pct\":%.1f,\"used_pct\":%.1f}\r\n",
+            100 - gimli.memuse, gimli.memuse);
+}
+
+/* Averages in percent, total in us, last_event in ms since the epoch. */
+static void
+render_pressure(gimli_str_t *out)
+{
+    const gimli_psi_t *ps;
+
+    str_printf(out, "{");
+    for (int r = 0; gimli.has_psi && r < PSI_NR; r++) {
+        str_printf(out, "%s\"%s\":{", r ? "," : "", psi_res[r]);
+        for (int k = 0; k < PSI_NRKINDS; k++) {
+            ps = &gimli.psi[r][k];
+            str_printf(out, "%s\"%s\":{\"avg10\":%.2f,\"avg60\":%.2f,"
+                    "\"avg300\":%.2f,\"total\":%llu,\"events\":%llu,"
+                    "\"last_event\":%lld}", k ? "," : "", psi_kinds[k],
+                    ps->avg[0], ps->avg[1], ps->avg[2], ps->total,
+                    ps->events, (long long) ps->last_event);
+        }
+        str_printf(out, "}");
+    }
+    str_printf(out, "}\r\n");
+}
+
+/* Rates over the last second, awaits in ms, utilization in percent. */
+static void
+render_disk(gimli_str_t *out)
+{
+    str_printf(out, "{\"disks\":[");
+    for (unsigned i = 0; i < gimli.ndisks; i++) {
+        str_printf(out, "%s{\"name\":", i ? "," : "");
+        json_str(out, gimli.disk[i].name);
+        for (int k = 0; k < DISK_NRSTATS; k++) {
+            str_printf(out, ",\"%s\":%.1f", disk_stats[k].json,
+                    gimli.disk[i].stat[k]);
+        }
+        str_printf(out, "}");
+    }
+    str_printf(out, "]}\r\n");
+}
+
+/*
+ * Cgroups with whatever files they have: cpu in percent of one core and
+ * usec, memory in bytes, io rates per second, pressure like /pressure.
+ */
+static void
+render_cgroups(gimli_str_t *out)
+{
+    const gimli_cgroup_t *cg;
+    const gimli_psi_t *ps;
+
+    str_printf(out, "{\"cgroups\":[");
+    for (unsigned i = 0; i < gimli.ncgroups; i++) {
+        cg = &gimli.cgroup[i];
+        str_printf(out, "%s{\"path\":", i ? "," : "");
+        json_str(out, cg->path);
+        if (cg->has & CG_HAS_CPU) {
+            str_printf(out, ",\"cpu\":{\"pct\":%.1f", cg->cpu_pct);
+            for (int k = 0; k < CGCPU_NRSTATS; k++) {
+                str_printf(out, ",\"%s\":%llu", cg_cpu_keys[k], cg->cpu[k]);
+            }
+            str_printf(out, "}");
+        }
+        if (cg->has & CG_HAS_MEM) {
+            str_printf(out, ",\"memory\":{\"current\":%llu",
+                    cg->mem_current);
+            for (int k = 0; k < CGMEM_NRSTATS; k++) {
+                str_printf(out, ",\"%s\":%llu", cg_mem_keys[k], cg->mem[k]);
+            }
+            str_printf(out, "}");
+        }
+        if (cg->has & CG_HAS_IO) {
+            str_printf(out, ",\"io\":{");
+            for (int k = 0; k < CGIO_NRSTATS; k++) {
+                str_printf(out, "%s\"%s\":%llu,\"%s_per_sec\":%.1f",
+                        k ? "," : "", cg_io_keys[k], cg->io[k],
+                        cg_io_keys[k], cg->io_rate[k]);
+            }
+            str_printf(out, "}");
+        }
+        if (cg->has & CG_HAS_PSI) {
+            str_printf(out, ",\"pressure\":{");
+            for (int r = 0; r < PSI_NR; r++) {
+                str_printf(out, "%s\"%s\":{", r ? "," : "", psi_res[r]);
+                for (int k = 0; k < PSI_NRKINDS; k++) {
+                    ps = &cg->psi[r][k];
+                    str_printf(out, "%s\"%s\":{\"avg10\":%.2f,"
+                            "\"avg60\":%.2f,\"avg300\":%.2f,\"total\":%llu}",
+                            k ? "," : "", psi_kinds[k], ps->avg[0],
+                            ps->avg[1], ps->avg[2], ps->total);
+                }
+                str_printf(out, "}");
+            }
+            str_printf(out, "}");
+        }
+        str_printf(out, "}");
+    }
+    str_printf(out, "]}\r\n");
+}
+
+/* Sizes in bytes, use in percent of what non-root users can have. */
+static void
+render_fs(gimli_str_t *out)
+{
+    const gimli_fs_t *fs;
+    double use;
+
+    str_printf(out, "{\"filesystems\":[");
+    for (unsigned i = 0; i < gimli.nfs; i++) {
+        fs = &gimli.fs[i];
+        // Like df(1), reserved blocks count as neither used nor free.
+        use = fs->used + fs->avail ?
+            100.0 * fs->used / (fs->used + fs->avail) : 0;
+        str_printf(out, "%s{\"mount\":", i ? "," : "");
+        json_str(out, fs->mount);
+        str_printf(out, ",\"source\":");
+        json_str(out, fs->source);
+        str_printf(out, ",\"fstype\":");
+        json_str(out, fs->fstype);
+        str_printf(out, ",\"size\":%llu,\"used\":%llu,\"avail\":%llu,"
+                "\"use\":%.1f,\"inodes\":%llu,\"inodes_free\":%llu,"
+                "\"stale\":%s}", fs->size, fs->used, fs->avail, use,
+                fs->files, fs->ffree, fs->stale ? "true" : "false");
+    }
+    str_printf(out, "]}\r\n");
+}
+
+static void
+render_root(gimli_str_t *out)
+{
+    int first = 1;
+
+    str_printf(out,
+            "{\n" \
+            "    \"cpu\": {\n" \
+            "        \"us\": %.1Lf,\n" \
+            "        \"sy\": %.1Lf,\n" \
+            "        \"id\": %.1Lf,\n" \
+            "        \"wa\": %.1Lf,\n" \
+            "        \"ni\": %.1Lf\n" \
+            "    },\n" \
+            "    \"load\": [%.2f, %.2f, %.2f],\n" \
+            "    \"uptime\": [%lu, %01lu, %02lu],\n" \
+            "    \"procs\": %hu,\n" \
+            "    \"cores\": %d,\n",
+            gimli.cpu[CPU_USER], gimli.cpu[CPU_SYSTEM],
+            gimli.cpu[CPU_IDLE], gimli.cpu[CPU_IOWAIT],
+            gimli.cpu[CPU_NICE], gimli.load[LOAD_ONE],
+            gimli.load[LOAD_FIVE], gimli.load[LOAD_FIFTEEN],
+            gimli.uptime/86400, gimli.uptime/3600%24, gimli.uptime/60%60,
+            gimli.procs, gimli.cores);
+    str_printf(out, "    \"netifs\": [");
+    for (unsigned i = 0; i < gimli.netifs; i++) {
+        if (gimli.net[i].naddr == 0) continue;
+        if (!first) {
+            str_printf(out, ", ");
+        }
+        str_printf(out, IFNAME_PRETTY_JSON);
+        json_str(out, gimli.net[i].ifname);
+        str_printf(out, ",\n        \"ipv4\": ");
+        render_ipv4(out, &gimli.net[i]);
+        str_printf(out, ",\n        \"ipv4s\": ");
+        render_addrs(out, &gimli.net[i], AF_INET);
+        str_printf(out, ",\n        \"ipv6\": ");
+        render_addrs(out, &gimli.net[i], AF_INET6);
+        str_printf(out, "\n    }");
+        first = 0;
+    }
+    str_printf(out, "]\n}\r\n");
+}
+
+static void
+render_err(gimli_str_t *out)
+{
+    str_printf(out, "{\"err\": 1}\r\n");
+}
+
+/**
+ * prom_label - append a Prometheus label value, escaped
+ */
+static void
+prom_label(gimli_str_t *out, const char *val)
+{
+    for (; *val != '\0'; val++) {
+        if (*val == '\\' || *val == '"') {
+            str_printf(out, "\\%c", *val);
+        } else if (*val == '\n') {
+            str_printf(out, "\\n");
+        } else {
+            str_printf(out, "%c", *val);
+        }
+    }
+}
+
+/**
+ * prom_head - append the HELP and TYPE lines of a Prometheus metric
+ */
+static void
+prom_head(gimli_str_t *out, const char *name, const char *type,
+        const char *help)
+{
+    str_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * The collectors' parts of /metrics, see render_metrics(). Like every
+ * renderer they run once per publish, over gimli into the renderer's
+ * reusable buffer.
+ */
+static void
+prom_cpu(gimli_str_t *out)
+{
+    static const char *const modes[CPU_NRSTATS] = {
+        [CPU_USER] = "user",     [CPU_NICE] = "nice",
+        [CPU_SYSTEM] = "system", [CPU_IDLE] = "idle",
+        [CPU_IOWAIT] = "iowait", [CPU_IRQ] = "irq",
+        [CPU_SOFTIRQ] = "softirq", [CPU_STEAL] = "steal",
+    };
+    const gimli_core_t *c;
+
+    prom_head(out, "gimli_cpu_usage_percent", "gauge",
+            "CPU time spent per mode over the last interval, in percent.");
+    for (int k = 0; k < CPU_NRSTATS; k++) {
+        str_printf(out, "gimli_cpu_usage_percent{mode=\"%s\"} %.1Lf\n",
+                modes[k], gimli.cpu[k]);
+    }
+
+    prom_head(out, "gimli_cpu_core_usage_percent", "gauge",
+            "CPU time spent per core and mode, in percent.");
+    for (int i = 0; gimli.percore != NULL && i < gimli.cores; i++) {
+        c = &gimli.percore[i];
+        if (c->pct[CPU_IDLE] < 0) continue;
+        for (int k = 0; k < CPU_NRSTATS; k++) {
+            str_printf(out,
+                    "gimli_cpu_core_usage_percent{cpu=\"%d\",mode=\"%s\"} "
+                    "%.1f\n", i, modes[k], c->pct[k]);
+        }
+    }
+
+    prom_head(out, "gimli_cores", "gauge", "Number of configured CPUs.");
+    str_printf(out, "gimli_cores %d\n", gimli.cores);
+}
+
+static void
+prom_load(gimli_str_t *out)
+{
+    prom_head(out, "gimli_load1", "gauge", "1 minute load average.");
+    str_printf(out, "gimli_load1 %.2f\n", gimli.load[LOAD_ONE]);
+    prom_head(out, "gimli_load5", "gauge", "5 minute load average.");
+    str_printf(out, "gimli_load5 %.2f\n", gimli.load[LOAD_FIVE]);
+    prom_head(out, "gimli_load15", "gauge", "15 minute load average.");
+    str_printf(out, "gimli_load15 %.2f\n", gimli.load[LOAD_FIFTEEN]);
+}
+
+static void
+prom_mem(gimli_str_t *out)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+    } mem[MEM_NRSTATS] = {
+        [TOTAL_RAM]  = { "gimli_memory_total_bytes", "Total usable RAM." },
+        [FREE_RAM]   = { "gimli_memory_free_bytes", "Free RAM." },
+        [SHARED_RAM] = { "gimli_memory_shared_bytes", "Shared RAM." },
+        [BUFFER_RAM] = { "gimli_memory_buffer_bytes", "RAM used by buffers." },
+        [TOTAL_SWAP] = { "gimli_swap_total_bytes", "Total swap space." },
+        [FREE_SWAP]  = { "gimli_swap_free_bytes", "Free swap space." },
+        [TOTAL_HIGH] = { "gimli_memory_high_total_bytes", "Total highmem." },
+        [FREE_HIGH]  = { "gimli_memory_high_free_bytes", "Free highmem." },
+        [AVAIL_RAM]  = { "gimli_memory_available_bytes",
+                         "RAM available without swapping." },
+        [CACHED_RAM] = { "gimli_memory_cached_bytes", "RAM used by page cache." },
+    };
+
+    for (int k = 0; k < MEM_NRSTATS; k++) {
+        prom_head(out, mem[k].name, "gauge", mem[k].help);
+        str_printf(out, "%s %lu\n", mem[k].name, gimli.meminfo[k] * 1024);
+    }
+    prom_head(out, "gimli_memory_used_percent", "gauge",
+            "RAM not available without swapping.");
+    str_printf(out, "gimli_memory_used_percent %.1f\n", gimli.memuse);
+
+    prom_head(out, "gimli_meminfo_bytes", "gauge",
+            "Fields of /proc/meminfo given in kB.");
+    for (unsigned i = 0; i < gimli.nmem; i++) {
+        if (gimli.mem[i].bytes) {
+            str_printf(out, "gimli_meminfo_bytes{field=\"%s\"} %llu\n",
+                    gimli.mem[i].name, gimli.mem[i].val);
+        }
+    }
+    prom_head(out, "gimli_meminfo", "gauge",
+            "Fields of /proc/meminfo without a unit.");
+    for (unsigned i = 0; i < gimli.nmem; i++) {
+        if (!gimli.mem[i].bytes) {
+            str_printf(out, "gimli_meminfo{field=\"%s\"} %llu\n",
+                    gimli.mem[i].name, gimli.mem[i].val);
+        }
+    }
+
+    prom_head(out, "gimli_uptime_seconds", "gauge", "System uptime.");
+    str_printf(out, "gimli_uptime_seconds %lu\n", gimli.uptime);
+    prom_head(out, "gimli_procs", "gauge", "Number of current processes.");
+    str_printf(out, "gimli_procs %hu\n", gimli.procs);
+}
+
+static void
+prom_psi(gimli_str_t *out)
+{
+    static const char *const avgs[3] = {
+        "gimli_pressure_avg10_percent", "gimli_pressure_avg60_percent",
+        "gimli_pressure_avg300_percent",
+    };
+
+    if (!gimli.has_psi) return;
+    for (int a = 0; a < 3; a++) {
+        prom_head(out, avgs[a], "gauge", "Share of time tasks stalled.");
+        for (int r = 0; r < PSI_NR; r++) {
+            for (int k = 0; k < PSI_NRKINDS; k++) {
+                str_printf(out, "%s{resource=\"%s\",kind=\"%s\"} %.2f\n",
+                        avgs[a], psi_res[r], psi_kinds[k],
+                        gimli.psi[r][k].avg[a]);
+            }
+        }
+    }
+    prom_head(out, "gimli_pressure_stalled_seconds_total", "counter",
+            "Time tasks stalled.");
+    for (int r = 0; r < PSI_NR; r++) {
+        for (int k = 0; k < PSI_NRKINDS; k++) {
+            str_printf(out, "gimli_pressure_stalled_seconds_total"
+                    "{resource=\"%s\",kind=\"%s\"} %.6f\n",
+                    psi_res[r], psi_kinds[k],
+                    gimli.psi[r][k].total / (double) MILLION);
+        }
+    }
+    prom_head(out, "gimli_pressure_trigger_events_total", "counter",
+            "Times a --psi-trigger fired.");
+    for (int r = 0; r < PSI_NR; r++) {
+        for (int k = 0; k < PSI_NRKINDS; k++) {
+            str_printf(out, "gimli_pressure_trigger_events_total"
+                    "{resource=\"%s\",kind=\"%s\"} %llu\n",
+                    psi_res[r], psi_kinds[k], gimli.psi[r][k].events);
+        }
+    }
+}
+
+static void
+prom_net(gimli_str_t *out)
+{
+    char ip[INET6_ADDRSTRLEN];
+    char name[64];
+
+    for (int k = 0; k < NET_NRSTATS; k++) {
+        snprintf(name, sizeof (name), "gimli_network_%s_total",
+                net_stats[k]);
+        prom_head(out, name, "counter", "Link counters of interfaces.");
+        for (unsigned i = 0; i < gimli.netifs; i++) {
+            str_printf(out, "%s{ifname=\"", name);
+            prom_label(out, gimli.net[i].ifname);
+            str_printf(out, "\"} %llu\n", gimli.net[i].stat.count[k]);
+        }
+    }
+
+    prom_head(out, "gimli_network_address_info", "gauge",
+            "IPv4 addresses of network interfaces, always 1.");
+    for (unsigned i = 0; i < gimli.netifs; i++) {
+        for (unsigned j = 0;
+                net_addr(&gimli.net[i], AF_INET, j, ip, sizeof (ip)); j++) {
+            str_printf(out, "gimli_network_address_info{ifname=\"");
+            prom_label(out, gimli.net[i].ifname);
+            str_printf(out, "\",ipv4=\"");
+            prom_label(out, ip);
+            str_printf(out, "\"} 1\n");
+        }
+    }
+
+    prom_head(out, "gimli_network_ipv6_address_info", "gauge",
+            "IPv6 addresses of network interfaces, always 1.");
+    for (unsigned i = 0; i < gimli.netifs; i++) {
+        for (unsigned j = 0;
+                net_addr(&gimli.net[i], AF_INET6, j, ip, sizeof (ip)); j++) {
+            str_printf(out, "gimli_network_ipv6_address_info{ifname=\"");
+            prom_label(out, gimli.net[i].ifname);
+            str_printf(out, "\",ipv6=\"");
+            prom_label(out, ip);
+            str_printf(out, "\"} 1\n");
+        }
+    }
+}
+
+static void
+prom_disk(gimli_str_t *out)
+{
+    for (int k = 0; k < DISK_NRSTATS; k++) {
+        prom_head(out, disk_stats[k].prom, "gauge", disk_stats[k].help);
+        for (unsigned i = 0; i < gimli.ndisks; i++) {
+            str_printf(out, "%s{device=\"", disk_stats[k].prom);
+            prom_label(out, gimli.disk[i].name);
+            str_printf(out, "\"} %.1f\n", gimli.disk[i].stat[k]);
+        }
+    }
+}
+
+static void
+prom_fs(gimli_str_t *out)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t off;
+    } fsm[] = {
+        { "gimli_filesystem_size_bytes", "Size of filesystems.",
+          offsetof(gimli_fs_t, size) },
+        { "gimli_filesystem_used_bytes", "Used space of filesystems.",
+          offsetof(gimli_fs_t, used) },
+        { "gimli_filesystem_avail_bytes",
+          "Space of filesystems available to non-root users.",
+          offsetof(gimli_fs_t, avail) },
+        { "gimli_filesystem_files", "Inodes of filesystems.",
+          offsetof(gimli_fs_t, files) },
+        { "gimli_filesystem_files_free", "Free inodes of filesystems.",
+          offsetof(gimli_fs_t, ffree) },
+    };
+
+    for (size_t k = 0; k < sizeof (fsm) / sizeof (fsm[0]); k++) {
+        prom_head(out, fsm[k].name, "gauge", fsm[k].help);
+        for (unsigned i = 0; i < gimli.nfs; i++) {
+            str_printf(out, "%s{mountpoint=\"", fsm[k].name);
+            prom_label(out, gimli.fs[i].mount);
+            str_printf(out, "\",fstype=\"");
+            prom_label(out, gimli.fs[i].fstype);
+            str_printf(out, "\"} %llu\n", *(const unsigned long long *)
+                    ((const char *) &gimli.fs[i] + fsm[k].off));
+        }
+    }
+}
+
+static void render_metrics(gimli_str_t *out);
+
+/*
+ * Indexed by enum resp, the views of the collectors are filled in by
+ * collectors_register(). Responses without a type are JSON.
+ */
+static struct {
+    void         (*render)(gimli_str_t *);
+    const char    *type;
+} renderers[RESP_NR] = {
+    [RESP_ROOT]      = { render_root,      NULL      },
+    [RESP_ERR]       = { render_err,       NULL      },
+    [RESP_METRICS]   = { render_metrics,   HTTP_PROM },
+};
+
+/**
+ * cache_retire - drop the cache's reference to a replaced buffer, once safe
+ *
+ * The event loops take references to cached buffers without locking, so
+ * a loop may have loaded the old pointer and be about to take one. Each
+ * loop notes cache.epoch when it wakes up, and 0 before it blocks, when
+ * it holds no such pointers. A buffer retired at epoch E is let go of
+ * once every loop is blocked or woke at E or later, so checking on each
+ * retire frees buffers a few publishes late at worst. Only the
+ * scheduler thread publishes.
+ */
+static void
+cache_retire(gimli_buf_t *b)
+{
+    gimli_loop_t *loops = atomic_load(&server.loop);
+    unsigned long min, qs;
+    unsigned i, n;
+
+    if (b == NULL) return;
+    if (loops == NULL) {
+        // No loop runs yet.
+        buf_unref(b);
+        return;
+    }
+    if (array_grow(&cache.retired, &cache.retiredcap, cache.nretired + 1,
+                sizeof (cache.retired[0])) != G_OK) {
+        // Leaked rather than freed too early.
+        return;
+    }
+    cache.retired[cache.nretired].buf = b;
+    cache.retired[cache.nretired++].epoch =
+        atomic_fetch_add(&cache.epoch, 1) + 1;
+
+    min = atomic_load(&cache.epoch);
+    for (i = 0; i < server.loops; i++) {
+        qs = atomic_load(&loops[i].qs);
+        if (qs != 0 && qs < min) min = qs;
+    }
+    for (i = n = 0; i < cache.nretired; i++) {
+        if (cache.retired[i].epoch <= min) {
+            buf_unref(cache.retired[i].buf);
+        } else {
+            cache.retired[n++] = cache.retired[i];
+        }
+    }
+    cache.nretired = n;
+}
+
+/**
+ * cache_publish - re-render the cached responses marked in dirty
+ *
+ * Each response is rendered once, headers included, into a fresh
+ * immutable buffer that replaces the cached one. Requests still sending
+ * the old buffer keep it alive through their own reference.
+ */
+static void
+cache_publish(unsigned dirty)
+{
+    static gimli_str_t out;
+    gimli_buf_t *b;
+
+    for (int r = 0; r < RESP_NR; r++) {
+        if (!(dirty & RESP_BIT(r)) || renderers[r].render == NULL) continue;
+
+        out.len = 0;
+        renderers[r].render(&out);
+        b = resp_new(200, renderers[r].type ? renderers[r].type : HTTP_JSON,
+                out.buf, out.len);
+        if (b == NULL) continue;
+
+        cache_retire(atomic_exchange(&cache.resp[r], b));
+    }
+}
+
+/**
+ * cache_get - take a reference to the cached response r
+ *
+ * Lock-free; only for the event loops and the publisher, see
+ * cache_retire().
+ */
+static gimli_buf_t *
+cache_get(enum resp r)
+{
+    gimli_buf_t *b = atomic_load(&cache.resp[r]);
+
+    return (b != NULL ? buf_ref(b) : NULL);
+}
+
+/**
+ * handle_server - report the event loop counters
+ *
+ * The counters are live, so this is rendered per request.
+ */
+static gimli_buf_t *
+handle_server(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+
+    str_printf(&out,
+            "{" \
+                "\"server\":{" \
+                    "\"loops\":%u," \
+                    "\"accepted\":%lu," \
+                    "\"served\":%lu," \
+                    "\"active\":%lu," \
+                    "\"streams\":%lu" \
+                "}" \
+            "}\r\n",
+            server.loops, atomic_load(&server.accepted),
+            atomic_load(&server.served), atomic_load(&server.active),
+            atomic_load(&server.streams));
+    b = out.buf != NULL ? resp_new(200, HTTP_JSON, out.buf, out.len) : NULL;
+    free(out.buf);
+    return (b);
+}
+
+/**
+ * query_get - find the value of a key in a request's query string
+ *
+ * Copies the value, NUL terminated, into val. Returns 0 if the key is
+ * missing or its value does not fit. Values are not URL-decoded.
+ */
+static int
+query_get(const gimli_http_t *req, const char *key, char *val, size_t size)
+{
+    size_t klen = strlen(key), vlen;
+    const char *p = req->query, *end;
+
+    while (*p != '\0') {
+        if ((end = strchr(p, '&')) == NULL) end = p + strlen(p);
+        if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+            p += klen + 1;
+            vlen = end - p;
+            if (vlen >= size) return (0);
+            memcpy(val, p, vlen);
+            val[vlen] = '\0';
+            return (1);
+        }
+        p = *end ? end + 1 : end;
+    }
+    return (0);
+}
+
+/**
+ * scan_ms - parse unix time in seconds, with optional decimals, as ms
+ */
+static const char *
+scan_ms(const char *p, int64_t *ms)
+{
+    unsigned long long sec, frac = 0;
+    int digits = 0;
+
+    if ((p = scan_u64(p, &sec)) == NULL) return (NULL);
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            if (digits++ < 3) frac = frac * 10 + (*p - '0');
+        }
+    }
+    for (; digits < 3; digits++) frac *= 10;
+    *ms = sec * 1000 + frac;
+    return (p);
+}
+
+/**
+ * hist_render - render the samples of h newer than since as JSON
+ *
+ * Samples are rendered as arrays, timestamp (unix seconds) first, in
+ * the order of h->fields. Only copying the wanted samples out of the
+ * ring runs under the seqlock, so a writer racing it costs a memcpy()
+ * rather than the whole rendering. Leaves out empty if out of memory.
+ */
+static void
+hist_render(gimli_str_t *out, const gimli_hist_t *h, int64_t since)
+{
+    unsigned long long first, last, lo, hi, mid, n, wrap;
+    const unsigned char *e;
+    unsigned char *copy;
+    unsigned seq;
+    int64_t t;
+    float v;
+
+    if ((copy = malloc((size_t) h->len * h->stride)) == NULL) return;
+    do {
+        seq = gimli_read_begin();
+
+        // Samples are in time order, binary search the first one wanted.
+        last = h->count;
+        first = last > h->len ? last - h->len : 0;
+        for (lo = first, hi = last; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            memcpy(&t, hist_entry(h, mid), sizeof (t));
+            if (t > since) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        // At most two runs: up to the end of the ring, then from its start.
+        n = last - lo;
+        wrap = h->len - lo % h->len;
+        if (wrap > n) wrap = n;
+        memcpy(copy, hist_entry(h, lo), wrap * h->stride);
+        memcpy(copy + wrap * h->stride, h->ring, (n - wrap) * h->stride);
+    } while (gimli_read_retry(seq));
+
+    str_printf(out, "{\"metric\":\"%s\",\"fields\":[", h->name);
+    for (unsigned k = 0; k < h->nfields; k++) {
+        str_printf(out, "%s\"%s\"", k ? "," : "", h->fields[k]);
+    }
+    str_printf(out, "],\"samples\":[");
+    for (unsigned long long i = 0; i < n; i++) {
+        e = copy + i * h->stride;
+        memcpy(&t, e, sizeof (t));
+        str_printf(out, "%s[%lld.%03lld", i ? "," : "",
+                (long long) (t / 1000), (long long) (t % 1000));
+        for (unsigned k = 0; k < h->nfields; k++) {
+            memcpy(&v, e + sizeof (t) + k * sizeof (v), sizeof (v));
+            str_printf(out, ",%.*f", h->prec, v);
+        }
+        str_printf(out, "]");
+    }
+    str_printf(out, "]}\r\n");
+    free(copy);
+}
+
+/**
+ * handle_top - the busiest processes, by=cpu|rss and n=1-TOP_MAX
+ *
+ * Copies the top out under the seqlock, then renders it.
+ */
+static gimli_buf_t *
+handle_top(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    static const char *const keys[TOP_NRKEYS] = {
+        [TOP_CPU] = "cpu", [TOP_RSS] = "rss",
+    };
+    gimli_top_t top[TOP_MAX];
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+    unsigned seq, n = TOP_DEFAULT, ntop, ntasks;
+    char val[16], *end;
+    int key = TOP_CPU;
+    long v;
+
+    if (query_get(req, "by", val, sizeof (val))) {
+        for (key = 0; key < TOP_NRKEYS && strcmp(val, keys[key]); key++);
+        if (key == TOP_NRKEYS) return (resp_error(400));
+    }
+    if (query_get(req, "n", val, sizeof (val))) {
+        v = strtol(val, &end, 10);
+        if (*val == '\0' || *end != '\0' || v < 1 || v > TOP_MAX) {
+            return (resp_error(400));
+        }
+        n = v;
+    }
+
+    do {
+        seq = gimli_read_begin();
+        ntop = gimli.ntop < n ? gimli.ntop : n;
+        ntasks = gimli.ntasks;
+        memcpy(top, gimli.top[key], ntop * sizeof (top[0]));
+    } while (gimli_read_retry(seq));
+
+    str_printf(&out, "{\"by\":\"%s\",\"tasks\":%u,\"top\":[", keys[key],
+            ntasks);
+    for (unsigned i = 0; i < ntop; i++) {
+        top[i].comm[TOP_COMMSIZ - 1] = '\0';
+        str_printf(&out, "%s{\"pid\":%d,\"comm\":", i ? "," : "",
+                top[i].pid);
+        json_str(&out, top[i].comm);
+        str_printf(&out, ",\"cpu\":%.1f,\"rss\":%llu,\"rss_delta\":%lld}",
+                top[i].cpu, top[i].rss, top[i].rss_delta);
+    }
+    str_printf(&out, "]}\r\n");
+
+    b = out.buf != NULL ? resp_new(200, HTTP_JSON, out.buf, out.len) : NULL;
+    free(out.buf);
+    return (b);
+}
+
+/**
+ * handle_history - serve recorded samples of one metric
+ *
+ * /history?metric=NAME[&since=T] returns the samples of NAME recorded
+ * after unix time T (all of them by default); without a metric it
+ * lists the metrics that have a history.
+ */
+static gimli_buf_t *
+handle_history(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+    const gimli_hist_t *h = NULL;
+    char name[32], since[32];
+    const char *p;
+    int64_t ms = 0;
+
+    if (query_get(req, "since", since, sizeof (since)) &&
+            ((p = scan_ms(since, &ms)) == NULL || *p != '\0')) {
+        return (resp_error(400));
+    }
+
+    if (!query_get(req, "metric", name, sizeof (name))) {
+        str_printf(&out, "{\"metrics\":[");
+        for (int i = 0; i < HIST_NR; i++) {
+            str_printf(&out, "%s\"%s\"", i ? "," : "", gimli.hist[i].name);
+        }
+        str_printf(&out, "]}\r\n");
+    } else {
+        for (int i = 0; i < HIST_NR; i++) {
+            if (strcmp(name, gimli.hist[i].name) == 0) h = &gimli.hist[i];
+        }
+        if (h == NULL) return (resp_error(404));
+        hist_render(&out, h, ms);
+    }
+
+    b = out.buf != NULL ? resp_new(200, HTTP_JSON, out.buf, out.len) : NULL;
+    free(out.buf);
+    return (b);
+}
+
+/*
+ * The endpoints of the server itself. Those without a handler are served
+ * straight from the response cache. collectors_register() adds those of
+ * the collectors and hands them all to router_init().
+ */
+static const gimli_route_t routes[] = {
+    { "/",           HTTP_GET, RESP_ROOT,      NULL,           NULL },
+    { "/server",     HTTP_GET, RESP_NR,        handle_server,  NULL },
+    { "/history",    HTTP_GET, RESP_NR,        handle_history, NULL },
+    { "/metrics",    HTTP_GET, RESP_METRICS,   NULL,           NULL },
+    { "/stream",     HTTP_GET, RESP_NR,        handle_stream,  NULL },
+    { "/ws",         HTTP_GET, RESP_NR,        handle_ws,      NULL },
+};
+
+/**
+ * http_reset - get a parser ready for the next request on a connection
+ */
+static void
+http_reset(gimli_http_t *h)
+{
+    memset(h, 0, offsetof(gimli_http_t, path));
+    h->state = HTTP_METHOD;
+    h->hash = router.seed;
+    h->path[0] = '\0';
+    h->query[0] = '\0';
+}
+
+/**
+ * http_error - stop parsing and remember which error status to answer
+ */
+static void
+http_error(gimli_http_t *h, int status)
+{
+    h->state = HTTP_ERROR;
+    h->status = status;
+}
+
+/**
+ * http_method - map the request method token to enum http_method
+ */
+static int
+http_method(const gimli_http_t *h)
+{
+    static const struct {
+        const char *name;
+        int         method;
+    } methods[] = {
+        { "GET",    HTTP_GET    },
+        { "HEAD",   HTTP_HEAD   },
+        { "POST",   HTTP_POST   },
+        { "PUT",    HTTP_PUT    },
+        { "DELETE", HTTP_DELETE },
+    };
+
+    for (size_t i = 0; i < sizeof (methods) / sizeof (methods[0]); i++) {
+        if (strcmp(h->name, methods[i].name) == 0) return (methods[i].method);
+    }
+    return (HTTP_OTHER);
+}
+
+/**
+ * http_token - check for a token in a comma separated header value
+ */
+static int
+http_token(const char *val, const char *token)
+{
+    size_t len = strlen(token);
+    const char *p = val;
+
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (strncasecmp(p, token, len) == 0 &&
+                (p[len] == '\0' || p[len] == ',' || p[len] == ' ' ||
+                 p[len] == '\t')) {
+            return (1);
+        }
+        while (*p != '\0' && *p != ',') p++;
+    }
+    return (0);
+}
+
+/**
+ * http_header - act on a complete header line
+ *
+ * Only the few headers that change how the connection is handled are
+ * looked at, everything else is skipped.
+ */
+static void
+http_header(gimli_http_t *h)
+{
+    unsigned long long len;
+    const char *p;
+
+    if (strcmp(h->name, "connection") == 0) {
+        if (http_token(h->val, "close")) h->flags |= HTTP_F_CLOSE;
+        if (http_token(h->val, "keep-alive")) h->flags |= HTTP_F_KEEPALIVE;
+        if (http_token(h->val, "upgrade")) h->flags |= HTTP_F_UPGRADE;
+    } else if (strcmp(h->name, "upgrade") == 0) {
+        if (http_token(h->val, "websocket")) h->flags |= HTTP_F_WEBSOCKET;
+    } else if (strcmp(h->name, "sec-websocket-key") == 0) {
+        if (strlen(h->val) == WS_KEYLEN) strcpy(h->wskey, h->val);
+    } else if (strcmp(h->name, "sec-websocket-version") == 0) {
+        h->wsversion = atoi(h->val);
+    } else if (strcmp(h->name, "content-length") == 0) {
+        if ((p = scan_u64(h->val, &len)) == NULL || *p != '\0') {
+            http_error(h, 400);
+            return;
+        }
+        h->bodylen = len;
+    } else if (strcmp(h->name, "transfer-encoding") == 0) {
+        // Requests bodies are never needed, chunked ones are not worth
+        // the trouble of skipping.
+        http_error(h, 501);
+    }
+}
+
+/**
+ * http_done - the head is complete, decide on keep-alive
+ */
+static void
+http_done(gimli_http_t *h)
+{
+    if (h->version == 11) {
+        h->keepalive = !(h->flags & HTTP_F_CLOSE);
+    } else if (h->version == 10) {
+        h->keepalive = !!(h->flags & HTTP_F_KEEPALIVE);
+    }
+    h->state = h->bodylen > 0 ? HTTP_BODY : HTTP_DONE;
+}
+
+/**
+ * http_parse - feed bytes of a request to the parser
+ *
+ * Consumes at most len bytes of p and returns how many were used. The
+ * parser keeps all of its state in h, so a request may arrive split at
+ * any byte across any number of reads, and never allocates. Parsing
+ * stops right after a request is complete (state HTTP_DONE) or broken
+ * (state HTTP_ERROR, with the status to answer in h->status); the
+ * caller handles it, calls http_reset() and feeds the rest.
+ *
+ * A request line without a version (HTTP/0.9 style, e.g. typed into
+ * nc) is complete at its end of line and has no headers. Request bodies
+ * are skipped.
+ */
+static size_t
+http_parse(gimli_http_t *h, const char *p, size_t len)
+{
+    size_t i;
+    char c;
+
+    for (i = 0; i < len; i++) {
+        c = p[i];
+
+        if (h->state == HTTP_BODY) {
+            size_t skip = len - i;
+            if (skip > h->bodylen) skip = h->bodylen;
+            h->bodylen -= skip;
+            i += skip;
+            if (h->bodylen == 0) h->state = HTTP_DONE;
+            return (i);
+        }
+        if (++h->headlen > HTTP_HEADMAX) {
+            http_error(h, 431);
+            return (i + 1);
+        }
+
+        switch (h->state) {
+        case HTTP_METHOD:
+            if (c == ' ') {
+                if (h->namelen == 0) {
+                    http_error(h, 400);
+                    break;
+                }
+                h->method = http_method(h);
+                h->namelen = 0;
+                h->state = HTTP_PATH;
+            } else if (c == '\r' || c == '\n') {
+                // Tolerate empty lines between requests.
+                if (h->namelen > 0) http_error(h, 400);
+            } else if (h->namelen + 1 < sizeof (h->name)) {
+                h->name[h->namelen++] = c;
+                h->name[h->namelen] = '\0';
+            } else {
+                http_error(h, 501);
+            }
+            break;
+
+        case HTTP_PATH:
+            if (c == '?' || c == ' ' || c == '\r' || c == '\n') {
+                if (h->pathlen == 0 || h->path[0] != '/') {
+                    http_error(h, 400);
+                    break;
+                }
+                if (c == '?') {
+                    h->state = HTTP_QUERY;
+                } else if (c == ' ') {
+                    h->state = HTTP_VERSION;
+                } else if (c == '\n') {
+                    h->version = 9;
+                    http_done(h);
+                    return (i + 1);
+                }
+            } else if (h->pathlen + 1 < sizeof (h->path)) {
+                h->path[h->pathlen++] = c;
+                h->path[h->pathlen] = '\0';
+                h->hash = (h->hash ^ (unsigned char) c) * ROUTE_FNV_PRIME;
+            } else {
+                http_error(h, 414);
+            }
+            break;
+
+        case HTTP_QUERY:
+            if (c == ' ') {
+                h->state = HTTP_VERSION;
+            } else if (c == '\n') {
+                h->version = 9;
+                http_done(h);
+                return (i + 1);
+            } else if (c == '\r') {
+                // Skip, the LF ends the line.
+            } else if (h->querylen + 1 < sizeof (h->query)) {
+                h->query[h->querylen++] = c;
+                h->query[h->querylen] = '\0';
+            } else {
+                http_error(h, 414);
+            }
+            break;
+
+        case HTTP_VERSION:
+            if (c == '\n') {
+                if (strcmp(h->val, "HTTP/1.0") == 0) {
+                    h->version = 10;
+                } else if (strncmp(h->val, "HTTP/1.", 7) == 0) {
+                    h->version = 11;
+                } else {
+                    http_error(h, 505);
+                    break;
+                }
+                h->vallen = 0;
+                h->state = HTTP_HEADER;
+            } else if (c == '\r') {
+                // Skip, the LF ends the line.
+            } else if (h->vallen + 1 < sizeof (h->val)) {
+                h->val[h->vallen++] = c;
+                h->val[h->vallen] = '\0';
+            } else {
+                http_error(h, 400);
+            }
+            break;
+
+        case HTTP_HEADER:
+            if (c == '\n') {
+                http_done(h);
+                if (h->state == HTTP_DONE) return (i + 1);
+                break;
+            } else if (c == '\r') {
+                // Skip, the LF ends the head.
+                break;
+            }
+            h->namelen = 0;
+            h->name[0] = '\0';
+            h->vallen = 0;
+            h->val[0] = '\0';
+            h->state = HTTP_HEADER_NAME;
+            /* FALLTHROUGH */
+
+        case HTTP_HEADER_NAME:
+            if (c == ':') {
+                h->state = HTTP_HEADER_SPACE;
+            } else if (c == '\n') {
+                http_error(h, 400);
+            } else if (h->namelen + 1 < sizeof (h->name)) {
+                // Names are case-insensitive, keep them lower case.
+                h->name[h->namelen++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+                h->name[h->namelen] = '\0';
+            } else {
+                // Too long to be one we care about, mangle it.
+                h->name[0] = '\0';
+            }
+            break;
+
+        case HTTP_HEADER_SPACE:
+            if (c == ' ' || c == '\t') break;
+            h->state = HTTP_HEADER_VALUE;
+            /* FALLTHROUGH */
+
+        case HTTP_HEADER_VALUE:
+            if (c == '\n') {
+                // Drop trailing blanks, including the CR.
+                while (h->vallen > 0 && (h->val[h->vallen - 1] == ' ' ||
+                            h->val[h->vallen - 1] == '\t' ||
+                            h->val[h->vallen - 1] == '\r')) {
+                    h->val[--h->vallen] = '\0';
+                }
+                http_header(h);
+                if (h->state == HTTP_ERROR) break;
+                h->state = HTTP_HEADER;
+            } else if (h->vallen + 1 < sizeof (h->val)) {
+                h->val[h->vallen++] = c;
+                h->val[h->vallen] = '\0';
+            }
+            break;
+
+        default:
+            return (i);
+        }
+
+        if (h->state == HTTP_ERROR) return (i + 1);
+    }
+    return (i);
+}
+
+/**
+ * route_hash - hash a path the way http_parse() does while reading it
+ */
+static uint32_t
+route_hash(uint32_t seed, const char *path)
+{
+    uint32_t h = seed;
+
+    while (*path != '\0') {
+        h = (h ^ (unsigned char) *path++) * ROUTE_FNV_PRIME;
+    }
+    return (h);
+}
+
+/**
+ * router_init - build the perfect hash table over nroutes routes
+ *
+ * Tries seeds for the FNV-1a path hash until every route lands in its
+ * own slot, growing the table if that takes too long. Lookups are then
+ * a single probe and one string compare no matter how many routes
+ * there are, and the hash is computed for free while the path is being
+ * parsed.
+ */
+static void
+router_init(const gimli_route_t *routes, unsigned nroutes)
+{
+    unsigned size, slot, tries;
+    const gimli_route_t **table;
+
+    for (size = 2; size < 2 * nroutes; size *= 2);
+    for (;;) {
+        if ((table = calloc(size, sizeof (*table))) == NULL) {
+            printf("router_init: out of memory\n");
+            exit(1);
+        }
+        for (tries = 0; tries < 1000; tries++) {
+            router.seed = ROUTE_FNV_BASIS + tries;
+            memset(table, 0, size * sizeof (*table));
+            unsigned i;
+            for (i = 0; i < nroutes; i++) {
+                slot = route_hash(router.seed, routes[i].path) & (size - 1);
+                if (table[slot] != NULL) break;
+                table[slot] = &routes[i];
+            }
+            if (i == nroutes) {
+                router.mask = size - 1;
+                router.slot = table;
+                return;
+            }
+        }
+        free(table);
+        size *= 2;
+    }
+}
+
+/**
+ * route_find - look up the route for a parsed request path
+ */
+static const gimli_route_t *
+route_find(const gimli_http_t *h)
+{
+    const gimli_route_t *r = router.slot[h->hash & router.mask];
+
+    if (r != NULL && strcmp(r->path, h->path) == 0) return (r);
+    return (NULL);
+}
+
+/**
+ * route_request - pick the response for a parsed request
+ *
+ * Returns a referenced buffer holding the complete response, or NULL
+ * if out of memory. Unknown paths get the cached error object, for
+ * compatibility with older clients that look for "err". HEAD matches
+ * GET routes, except for /stream and /ws: a stream has no head apart
+ * from the stream itself.
+ */
+static gimli_buf_t *
+route_request(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    const gimli_route_t *r;
+    int method = req->method;
+
+    if (req->state == HTTP_ERROR) {
+        return (resp_error(req->status));
+    }
+    if ((r = route_find(req)) == NULL) {
+        return (cache_get(RESP_ERR));
+    }
+    if (method == HTTP_HEAD && r->handler != handle_stream &&
+            r->handler != handle_ws) {
+        method = HTTP_GET;
+    }
+    if (method != r->method) {
+        return (resp_error(405));
+    }
+    if (r->coll != NULL && r->coll->disabled) {
+        return (resp_error(503));
+    }
+    if (r->handler != NULL) {
+        return (r->handler(conn, req));
+    }
+    return (cache_get(r->resp));
+}
+
+/**
+ * resp_head - the headers of response b alone, for a HEAD request
+ *
+ * Content-Length still describes the body a GET would get. Takes over
+ * the reference to b; returns NULL if out of memory.
+ */
+static gimli_buf_t *
+resp_head(gimli_buf_t *b)
+{
+    gimli_buf_t *head;
+    const char *end;
+
+    if (b == NULL) return (NULL);
+    end = memmem(b->data, b->len, "\r\n\r\n", 4);
+    if (end == NULL || (head = buf_alloc(end + 4 - b->data)) == NULL) {
+        buf_unref(b);
+        return (NULL);
+    }
+    memcpy(head->data, b->data, head->len);
+    buf_unref(b);
+    return (head);
+}
+
+/**
+ * handle_request - answer a parsed request
+ *
+ * HEAD is answered like GET, minus the body.
+ */
+static gimli_buf_t *
+handle_request(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    gimli_buf_t *b = route_request(conn, req);
+
+    return (req->method == HTTP_HEAD ? resp_head(b) : b);
+}
+
+/**
+ * conn_close - tear down a connection
+ *
+ * Closing the fd also removes it from the owning epoll set.
+ */
+static void
+conn_close(gimli_conn_t *conn)
+{
+    gimli_sub_t *sub = conn->sub;
+
+    if (sub != NULL) {
+        if (sub->prev != NULL) {
+            sub->prev->next = sub->next;
+        } else {
+            conn->loop->subs = sub->next;
+        }
+        if (sub->next != NULL) sub->next->prev = sub->prev;
+        atomic_fetch_sub(&conn->loop->nsubs, 1);
+        atomic_fetch_sub(&server.streams, 1);
+        free(sub);
+    }
+    close(conn->fd);
+    while (conn->outcnt > 0) {
+        buf_unref(conn->outq[conn->outhead]);
+        conn->outhead = (conn->outhead + 1) % CONN_OUTQ;
+        conn->outcnt--;
+    }
+    free(conn);
+    atomic_fetch_sub_explicit(&server.active, 1, memory_order_relaxed);
+}
+
+/**
+ * conn_flush - send as much of the queued responses as the socket takes
+ *
+ * All queued responses go out in one writev() where possible. Returns
+ * G_OK when the queue has been drained, G_FAIL when the socket is full
+ * (EPOLLOUT will resume us) or the peer went away, in which case errno
+ * is not EAGAIN and the caller should close.
+ */
+static status_t
+conn_flush(gimli_conn_t *conn)
+{
+    struct iovec iov[CONN_OUTQ];
+    gimli_buf_t *b;
+    unsigned i, n;
+    ssize_t sent;
+    size_t left;
+
+    while (conn->outcnt > 0) {
+        for (n = 0; n < conn->outcnt; n++) {
+            b = conn->outq[(conn->outhead + n) % CONN_OUTQ];
+            iov[n].iov_base = b->data;
+            iov[n].iov_len = b->len;
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + conn->outoff;
+        iov[0].iov_len -= conn->outoff;
+
+        sent = sendmsg(conn->fd, &(struct msghdr) {
+                .msg_iov = iov, .msg_iovlen = n }, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return (G_FAIL);
+        }
+
+        // Retire every response that went out completely.
+        for (i = 0; i < n && (size_t) sent >= iov[i].iov_len; i++) {
+            sent -= iov[i].iov_len;
+            buf_unref(conn->outq[conn->outhead]);
+            conn->outhead = (conn->outhead + 1) % CONN_OUTQ;
+            conn->outcnt--;
+            conn->outoff = 0;
+            atomic_fetch_add_explicit(&server.served, 1,
+                    memory_order_relaxed);
+        }
+        left = sent;
+        conn->outoff += left;
+    }
+    return (G_OK);
+}
+
+/**
+ * conn_queue - queue a buffer to send, the caller made sure there is room
+ */
+static void
+conn_queue(gimli_conn_t *conn, gimli_buf_t *b)
+{
+    conn->outq[(conn->outhead + conn->outcnt) % CONN_OUTQ] = b;
+    conn->outcnt++;
+}
+
+/**
+ * conn_process - answer every complete request sitting in the buffer
+ *
+ * Bytes are fed to the connection's parser as they arrive, so only
+ * what could not be parsed yet stays in the buffer. Pipelined requests
+ * are answered in order, as long as there is room in the response
+ * queue. Broken requests are answered with an error and the connection
+ * closed. Once a connection is a /stream, whatever else the client
+ * sends is ignored; after a WebSocket upgrade it is read as frames.
+ */
+static void
+conn_process(gimli_conn_t *conn)
+{
+    gimli_http_t *req = &conn->req;
+    gimli_buf_t *b;
+    size_t off = 0;
+
+    while (!conn->closing && conn->sub == NULL) {
+        if (req->state == HTTP_DONE || req->state == HTTP_ERROR) {
+            if (conn->outcnt == CONN_OUTQ) break;
+            if ((b = handle_request(conn, req)) == NULL) {
+                conn->closing = 1;
+                break;
+            }
+            conn_queue(conn, b);
+            conn->closing = req->state == HTTP_ERROR ||
+                (!req->keepalive && conn->sub == NULL);
+            http_reset(req);
+            continue;
+        }
+        if (off == conn->len) break;
+        off += http_parse(req, conn->buf + off, conn->len - off);
+    }
+    if (conn->sub != NULL && conn->sub->ws) {
+        off += ws_process(conn, conn->buf + off, conn->len - off);
+    } else if (conn->sub != NULL) {
+        off = conn->len;
+    }
+
+    // Keep whatever was not fed to the parser for the next round.
+    conn->len -= off;
+    memmove(conn->buf, conn->buf + off, conn->len);
+}
+
+/**
+ * conn_send - flush responses and close the connection when done
+ *
+ * Whenever the queue drains, requests that were held back because it
+ * was full are answered too. Returns G_FAIL if the connection was
+ * closed.
+ */
+static status_t
+conn_send(gimli_conn_t *conn)
+{
+    for (;;) {
+        if (conn_flush(conn) != G_OK) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return (G_OK);
+            conn_close(conn);
+            return (G_FAIL);
+        }
+        if (conn->closing) {
+            shutdown(conn->fd, SHUT_RDWR);
+            conn_close(conn);
+            return (G_FAIL);
+        }
+        conn_process(conn);
+        if (conn->outcnt == 0) return (G_OK);
+    }
+}
+
+/**
+ * conn_readable - drain the socket and answer every complete request
+ *
+ * Sockets are edge-triggered, so we must read until EAGAIN. The only
+ * exception is a client that pipelines more than CONN_OUTQ requests
+ * without reading responses: reading is then paused until the queue
+ * has room again, see conn_writable().
+ */
+static void
+conn_readable(gimli_conn_t *conn)
+{
+    ssize_t n;
+
+    do {
+        conn->paused = 0;
+        for (;;) {
+            conn_process(conn);
+            if (conn->closing) {
+                // Nothing more will be answered, just drain the socket.
+                char discard[CONN_BUFSIZ];
+                n = recv(conn->fd, discard, sizeof (discard), 0);
+            } else if (conn->len < sizeof (conn->buf)) {
+                n = recv(conn->fd, conn->buf + conn->len,
+                        sizeof (conn->buf) - conn->len, 0);
+            } else {
+                // Buffer only fills up while the queue is full.
+                conn->paused = 1;
+                break;
+            }
+            if (n == 0) {
+                // Peer is done sending, answer what we have and close.
+                conn->closing = 1;
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                conn_close(conn);
+                return;
+            }
+            if (conn->closing) continue;
+            conn->len += n;
+        }
+
+        if (conn_send(conn) != G_OK) return;
+        // The queue may have drained right away, the socket may hold more.
+    } while (conn->paused && conn->outcnt < CONN_OUTQ);
+}
+
+/**
+ * stream_due - have the loop wake up at due for held back events
+ */
+static void
+stream_due(gimli_loop_t *loop, int64_t due)
+{
+    if (due != 0 && (loop->due == 0 || due < loop->due)) {
+        loop->due = due;
+    }
+}
+
+/**
+ * conn_writable - resume sending responses the socket could not take
+ *
+ * For a /stream that is also when the events that did not fit go out.
+ */
+static void
+conn_writable(gimli_conn_t *conn)
+{
+    gimli_loop_t *loop = conn->loop;
+
+    if (conn->outcnt == 0) return;
+    if (conn_send(conn) != G_OK) return;
+    if (conn->sub != NULL) {
+        stream_due(loop, stream_send(conn, mono_ms()));
+        return;
+    }
+    if (conn->paused && conn->outcnt < CONN_OUTQ) {
+        conn_readable(conn);
+    }
+}
+
+/**
+ * conn_accept - accept every pending connection on a listener
+ *
+ * New sockets are non-blocking and handed to the epoll set of the loop
+ * that accepted them; they never migrate between loops.
+ */
+static void
+conn_accept(gimli_loop_t *loop, gimli_listen_t *lsn)
+{
+    int fd;
+    gimli_conn_t *conn;
+    struct epoll_event ev;
+
+    for (;;) {
+        fd = accept4(lsn->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("accept failed: %m\n");
+            }
+            return;
+        }
+        atomic_fetch_add_explicit(&server.accepted, 1, memory_order_relaxed);
+
+        if ((conn = malloc(sizeof (*conn))) == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->kind = EV_CONN;
+        conn->fd = fd;
+        conn->len = 0;
+        conn->outhead = 0;
+        conn->outcnt = 0;
+        conn->outoff = 0;
+        conn->closing = 0;
+        conn->paused = 0;
+        conn->loop = loop;
+        conn->sub = NULL;
+        http_reset(&conn->req);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        atomic_fetch_add_explicit(&server.active, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * server_loop - run one event loop forever
+ *
+ * Every loop has its own SO_REUSEPORT listening sockets, so the kernel
+ * spreads incoming connections across loops, and owns the connections
+ * it accepted. Events for its /stream connections that are held back
+ * set the epoll_wait() timeout.
+ */
+static void *
+server_loop(void *arg)
+{
+    gimli_loop_t *loop = arg;
+    struct epoll_event events[SERVER_EVENTS];
+    cpu_set_t set;
+    int64_t timeout;
+    uint64_t val;
+    int n, wake;
+
+    if (loop->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof (set), &set)) {
+            printf("loop %u: cannot pin to cpu %d\n", loop->id, loop->cpu);
+        }
+    }
+    for (;;) {
+        timeout = -1;
+        if (loop->due != 0) {
+            timeout = loop->due - mono_ms();
+            if (timeout < 0) timeout = 0;
+        }
+        // Blocked, see cache_retire().
+        atomic_store(&loop->qs, 0);
+        n = epoll_wait(loop->epfd, events, SERVER_EVENTS, (int) timeout);
+        atomic_store(&loop->qs, atomic_load(&cache.epoch));
+        wake = 0;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            printf("epoll_wait failed: %m\n");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            int kind = *(int *) events[i].data.ptr;
+
+            if (kind == EV_LISTEN) {
+                conn_accept(loop, events[i].data.ptr);
+                continue;
+            }
+            if (kind == EV_WAKE) {
+                read(loop->wake.fd, &val, sizeof (val));
+                wake = 1;
+                continue;
+            }
+            gimli_conn_t *conn = events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(conn);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                // May close conn, so it must be the last thing we do.
+                conn_readable(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn_writable(conn);
+            }
+        }
+        // Not before now: sending may close connections with events above.
+        if (wake || (loop->due != 0 && mono_ms() >= loop->due)) {
+            stream_flush(loop);
+        }
+    }
+
+    /* Never reached. */
+    return (void *) {0};
+}
+
+/**
+ * listen_resolve - resolve an address to listen on
+ *
+ * The address is HOST, HOST:PORT or [HOST]:PORT, where an empty HOST or
+ * "*" means any; a name may resolve to several addresses. IPv6 sockets
+ * only take IPv6 connections unless dual is set, in which case "::"
+ * serves IPv4 clients as well through mapped addresses.
+ */
+static status_t
+listen_resolve(const char *spec, int dual, gimli_bind_t *b, unsigned *nb)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[NI_MAXHOST], port[8];
+    const char *p;
+    int err;
+
+    snprintf(port, sizeof (port), "%d", SERVER_PORT);
+    if (spec[0] == '[' && (p = strchr(spec, ']')) != NULL) {
+        snprintf(host, sizeof (host), "%.*s", (int) (p - spec - 1), spec + 1);
+        p = (p[1] == ':') ? p + 2 : NULL;
+    } else if ((p = strrchr(spec, ':')) != NULL && strchr(spec, ':') == p) {
+        snprintf(host, sizeof (host), "%.*s", (int) (p - spec), spec);
+        p++;
+    } else {
+        // No port, or a bare IPv6 address.
+        snprintf(host, sizeof (host), "%s", spec);
+        p = NULL;
+    }
+
+    memset(&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    err = getaddrinfo(host[0] == '\0' || strcmp(host, "*") == 0 ? NULL :
+            host, p && *p ? p : port, &hints, &res);
+    if (err != 0) {
+        printf("gimli: %s: %s\n", spec, gai_strerror(err));
+        return (G_FAIL);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if (*nb == SERVER_LISTEN) {
+            printf("gimli: too many listening sockets\n");
+            break;
+        }
+        memcpy(&b[*nb].addr, ai->ai_addr, ai->ai_addrlen);
+        b[*nb].len = ai->ai_addrlen;
+        b[(*nb)++].dual = dual;
+    }
+    freeaddrinfo(res);
+    return (G_OK);
+}
+
+/**
+ * listen_socket - open one loop's listening socket for an address
+ *
+ * Returns the socket or -1. With SO_REUSEPORT every loop binds its own
+ * socket to the same address and the kernel balances between them.
+ */
+static int
+listen_socket(const gimli_bind_t *b)
+{
+    int fd;
+
+    fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            0);
+    if (fd == -1) {
+        return (-1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof (int));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 },
+                sizeof (int)) == -1) {
+        close(fd);
+        return (-1);
+    }
+    if (b->addr.ss_family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ !b->dual },
+                sizeof (int));
+    }
+    if (bind(fd, (const struct sockaddr *) &b->addr, b->len) == -1 ||
+            listen(fd, conf.backlog) == -1) {
+        close(fd);
+        return (-1);
+    }
+    return (fd);
+}
+
+/**
+ * cpu_nth - the nth cpu of a set, wrapping around
+ */
+static int
+cpu_nth(const cpu_set_t *set, unsigned nth)
+{
+    nth %= CPU_COUNT(set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && nth-- == 0) {
+            return (cpu);
+        }
+    }
+    return (-1);
+}
+
+static void *
+handle_connections()
+{
+    static gimli_bind_t binds[SERVER_LISTEN];
+    static gimli_loop_t *loops;
+    struct epoll_event ev;
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+    unsigned nbinds = 0;
+    gimli_loop_t *loop;
+    int fd;
+
+    /*
+     * By default a single dual-stack socket takes both IPv4 and IPv6,
+     * falling back to IPv4 only on hosts without IPv6.
+     */
+    if (conf.nlisten == 0) {
+        if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) != -1) {
+            close(fd);
+            listen_resolve("[::]", 1, binds, &nbinds);
+        } else {
+            listen_resolve("0.0.0.0", 0, binds, &nbinds);
+        }
+    }
+    for (unsigned i = 0; i < conf.nlisten; i++) {
+        if (listen_resolve(conf.listen[i], 0, binds, &nbinds) != G_OK) {
+            exit(1);
+        }
+    }
+    if (nbinds == 0) {
+        printf("gimli: nothing to listen on\n");
+        exit(1);
+    }
+
+    /* One event loop per core, up to SERVER_LOOPS, unless told. */
+    server.loops = conf.threads;
+    if (server.loops == 0 && CPU_COUNT(&conf.cpus) > 0) {
+        server.loops = CPU_COUNT(&conf.cpus);
+    }
+    if (server.loops == 0) {
+        server.loops = sysconf(_SC_NPROCESSORS_ONLN);
+        if (server.loops < 1) server.loops = 1;
+        if (server.loops > SERVER_LOOPS) server.loops = SERVER_LOOPS;
+    }
+    if ((loops = calloc(server.loops, sizeof (*loops))) == NULL) {
+        printf("gimli: out of memory\n");
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < server.loops; i++) {
+        loop = &loops[i];
+        loop->id = i;
+        loop->cpu = CPU_COUNT(&conf.cpus) ? cpu_nth(&conf.cpus, i) : -1;
+        if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            printf("epoll_create1 failed: %m\n");
+            exit(1);
+        }
+        for (unsigned j = 0; j < nbinds; j++) {
+            getnameinfo((struct sockaddr *) &binds[j].addr, binds[j].len,
+                    host, sizeof (host), serv, sizeof (serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+            if ((fd = listen_socket(&binds[j])) == -1) {
+                printf("Couldn't listen on %s port %s: %m\n", host, serv);
+                exit(1);
+            }
+            if (i == 0) {
+                printf(binds[j].addr.ss_family == AF_INET6 ?
+                        "Listening at: [%s]:%s (%d)\n" :
+                        "Listening at: %s:%s (%d)\n",
+                        host, serv, (int) getpid());
+            }
+            loop->lsn[j].kind = EV_LISTEN;
+            loop->lsn[j].fd = fd;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &loop->lsn[j];
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                printf("epoll_ctl failed: %m\n");
+                exit(1);
+            }
+        }
+        loop->nlsn = nbinds;
+
+        loop->wake.kind = EV_WAKE;
+        loop->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->wake;
+        if (loop->wake.fd == -1 ||
+                epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake.fd, &ev) == -1) {
+            printf("eventfd failed: %m\n");
+            exit(1);
+        }
+    }
+    atomic_store(&server.loop, loops);
+
+    /* The calling thread runs the first loop itself. */
+    for (unsigned i = 1; i < server.loops; i++) {
+        thread_create_detached(&server_loop, &loops[i]);
+    }
+    return server_loop(&loops[0]);
+}
+
+/*
+ * The collector scheduler. A single thread samples every collector on
+ * wall clock multiples of its interval, so metrics sampled on the same
+ * tick line up, and one timerfd wakes it only when the next sample is
+ * due. Collectors that follow kernel notifications register their fds
+ * with sched_watch() and get event() calls from the same thread.
+ */
+static int sched_epfd = -1;
+static int sched_wakefd = -1;                 // eventfd, see sched_wake()
+static unsigned sched_cur;                    // collector being run
+
+/**
+ * sched_watch - have the collector being run told when fd is ready
+ *
+ * The fd is dropped from the set by closing it.
+ */
+static status_t
+sched_watch(int fd, unsigned events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.u64 = (uint64_t) sched_cur << 32 | (uint32_t) fd,
+    };
+
+    if (epoll_ctl(sched_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return (G_FAIL);
+    }
+    return (G_OK);
+}
+
+/**
+ * sched_wake - have the scheduler look at the collectors again
+ *
+ * For the event loops, after enabling or disabling a collector.
+ */
+static void
+sched_wake(void)
+{
+    uint64_t one = 1;
+
+    if (sched_wakefd >= 0 && write(sched_wakefd, &one, sizeof (one)) < 0) {
+        printf("sched_wake: %s\n", strerror(errno));
+    }
+}
+
+static status_t
+cpu_init(void)
+{
+    gimli_core_t *percore;
+    int cores;
+
+    // The per-core table is allocated once and never moves, so readers
+    // may follow gimli.percore without holding anything.
+    cores = sysconf(_SC_NPROCESSORS_CONF);
+    if (cores < 1) cores = 1;
+    if ((percore = calloc(cores, sizeof (*percore))) == NULL ||
+            (cpu_core = calloc(cores, sizeof (*cpu_core))) == NULL) {
+        printf("cpu_init: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < cores; i++) {
+        percore[i].pct[CPU_IDLE] = -1;
+        cpu_core[i].pct[CPU_IDLE] = -1;
+    }
+    cpu_cores = cores;
+
+    gimli_write_begin();
+    gimli.cores = cores;
+    gimli.percore = percore;
+    gimli_write_end(0);
+    return (G_OK);
+}
+
+/*
+ * Interfaces come and go rarely, so instead of rebuilding the table every
+ * interval it is dumped once and then kept current from rtnetlink
+ * notifications. Only the link counters are sampled, with one
+ * RTM_GETLINK dump per interval.
+ */
+static int nlfd = -1;
+static int nlresync = 1;                      // dump everything next time
+
+static status_t
+net_init(void)
+{
+    if ((nlfd = nl_open()) < 0) {
+        printf("net_init: rtnetlink: %s\n", strerror(errno));
+        return (G_FAIL);
+    }
+    return (sched_watch(nlfd, EPOLLIN));
+}
+
+static status_t
+net_sample(void)
+{
+    if (nlresync) {
+        link_clear();
+        if (nl_dump(nlfd, RTM_GETLINK) != G_OK ||
+                nl_dump(nlfd, RTM_GETADDR) != G_OK) {
+            return (G_FAIL);
+        }
+        nlresync = 0;
+    } else if (nl_dump(nlfd, RTM_GETLINK) != G_OK) {
+        nlresync = 1;
+        return (G_FAIL);
+    }
+    return (G_OK);
+}
+
+/* Notifications were lost if the socket overran, then start over. */
+static int
+net_event(int fd, unsigned events)
+{
+    int r, changed = 0, unused;
+
+    while ((r = nl_recv(fd, 0, MSG_DONTWAIT, &unused)) > 0) {
+        changed = 1;
+    }
+    if (r < 0) {
+        nlresync = 1;
+        return (SCHED_SAMPLE);
+    }
+    return (changed ? SCHED_PUBLISH : SCHED_NONE);
+}
+
+/*
+ * mountinfo is only re-read when it changes: the kernel flags its fd
+ * with EPOLLPRI (and EPOLLERR) whenever the mount table is modified.
+ * The statvfs() worker reports finished batches on fs_evfd.
+ */
+static gimli_proc_t mountinfo = PROC_FILE(PROC_MOUNTINFO);
+
+static status_t
+fs_init(void)
+{
+    int fd = mountinfo.fd;
+
+    if (fs_evfd < 0) {
+        if ((fs_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+                sched_watch(fs_evfd, EPOLLIN) != G_OK) {
+            printf("fs_init: eventfd: %s\n", strerror(errno));
+            return (G_FAIL);
+        }
+    }
+
+    if (proc_read(&mountinfo) != G_OK || fs_mounts(mountinfo.buf) != G_OK) {
+        printf("fs_init: mountinfo: %s\n", strerror(errno));
+        return (G_FAIL);
+    }
+    // proc_read() opens it again after an error.
+    if (mountinfo.fd != fd) {
+        return (sched_watch(mountinfo.fd, EPOLLPRI));
+    }
+    return (G_OK);
+}
+
+static int
+fs_event(int fd, unsigned events)
+{
+    uint64_t val;
+
+    if (fd == fs_evfd) {
+        read(fs_evfd, &val, sizeof (val));
+        return (fs_done() == G_OK ? SCHED_PUBLISH : SCHED_NONE);
+    }
+    return (fs_init() == G_OK ? SCHED_SAMPLE : SCHED_NONE);
+}
+
+/*
+ * Pressure is sampled every interval, and right away whenever one of the
+ * --psi-trigger fds fires, so a stall shows up within milliseconds.
+ */
+static status_t
+psi_init(void)
+{
+    gimli_psitrig_t *t;
+
+    if (access(PROC_PRESSURE "cpu", R_OK) != 0) {
+        printf("psi_init: no pressure stall information\n");
+        return (G_FAIL);
+    }
+    for (unsigned i = 0; i < conf.npsitrig; i++) {
+        t = &conf.psitrig[i];
+        if ((t->fd = psi_trigger(t)) < 0 ||
+                sched_watch(t->fd, EPOLLPRI) != G_OK) {
+            printf("psi_init: cannot arm %s %s %u:%u trigger: %s\n",
+                    psi_res[t->res], psi_kinds[t->kind], t->stall, t->window,
+                    strerror(errno));
+        }
+    }
+    return (G_OK);
+}
+
+static status_t
+psi_sample(void)
+{
+    for (int r = 0; r < PSI_NR; r++) {
+        if (psi_read(r) != G_OK) {
+            printf("psi_read %s failed\n", psi_res[r]);
+        }
+    }
+    return (G_OK);
+}
+
+static int
+psi_event(int fd, unsigned events)
+{
+    gimli_psitrig_t *t = conf.psitrig;
+
+    while (t < conf.psitrig + conf.npsitrig && t->fd != fd) t++;
+    if (t == conf.psitrig + conf.npsitrig) return (SCHED_NONE);
+    if (events & EPOLLERR) {
+        // The trigger is gone, stop watching it.
+        close(t->fd);
+        t->fd = -1;
+        return (SCHED_NONE);
+    }
+    psi[t->res][t->kind].events++;
+    psi[t->res][t->kind].last_event = now_ms();
+    psi_read(t->res);
+    return (SCHED_PUBLISH);
+}
+
+static status_t
+top_init(void)
+{
+    if ((procdir = opendir(PROC_DIR)) == NULL) {
+        printf("top_init: %s: %s\n", PROC_DIR, strerror(errno));
+        return (G_FAIL);
+    }
+    clk_tck = sysconf(_SC_CLK_TCK);
+    page_size = sysconf(_SC_PAGESIZE);
+    return (G_OK);
+}
+
+/*
+ * The cgroup tree is walked once and then kept current from inotify, so
+ * only new cgroups are ever listed; a sample is a few openat() per
+ * cgroup. Each cgroup holds a directory fd, so the fd limit is raised as
+ * far as it goes.
+ */
+static int cgresync = 1;                      // walk the tree next time
+
+static status_t
+cg_init(void)
+{
+    struct rlimit rl;
+
+    if (cg_mount() != G_OK) {
+        printf("cg_init: no cgroup2 hierarchy\n");
+        return (G_FAIL);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return (G_OK);
+}
+
+static status_t
+cg_sample(void)
+{
+    if (cgresync) {
+        if (cg_sync() != G_OK || sched_watch(cgifd, EPOLLIN) != G_OK) {
+            printf("cg_sample: %s: %s\n", cgmount, strerror(errno));
+            return (G_FAIL);
+        }
+        cgresync = 0;
+    }
+    return (get_cgroups());
+}
+
+static int
+cg_event(int fd, unsigned events)
+{
+    if (cg_events() != G_OK) {
+        cgresync = 1;
+        return (SCHED_SAMPLE);
+    }
+    return (SCHED_NONE);
+}
+
+/* The endpoints of each collector. */
+static const gimli_view_t cpu_views[] = {
+    { "/cpu",        render_cpu,       NULL       },
+    { "/cpu/cores",  render_cpu_cores, NULL       },
+    { "/cores",      render_cores,     NULL       },
+    { NULL },
+};
+static const gimli_view_t load_views[] = {
+    { "/load",       render_load,      NULL       },
+    { NULL },
+};
+static const gimli_view_t mem_views[] = {
+    { "/meminfo",    render_meminfo,   NULL       },
+    { "/uptime",     render_uptime,    NULL       },
+    { "/procs",      render_procs,     NULL       },
+    { NULL },
+};
+static const gimli_view_t net_views[] = {
+    { "/net",        render_net,       NULL       },
+    { NULL },
+};
+static const gimli_view_t disk_views[] = {
+    { "/disk",       render_disk,      NULL       },
+    { NULL },
+};
+static const gimli_view_t fs_views[] = {
+    { "/fs",         render_fs,        NULL       },
+    { NULL },
+};
+static const gimli_view_t psi_views[] = {
+    { "/pressure",   render_pressure,  NULL       },
+    { NULL },
+};
+static const gimli_view_t top_views[] = {
+    { "/procs/top",  NULL,             handle_top },
+    { NULL },
+};
+static const gimli_view_t cg_views[] = {
+    { "/cgroups",    render_cgroups,   NULL       },
+    { NULL },
+};
+
+/*
+ * The registry of collectors. Adding one takes an entry here, nothing
+ * else: the scheduler runs it, collectors_register() routes and renders
+ * its views, and /collectors lets it be disabled at runtime.
+ */
+static gimli_collector_t collectors[] = {
+    {
+        .name = "cpu", .interval = CPU_INTERVAL, .init = cpu_init,
+        .sample = get_cpu_util, .publish = cpu_publish,
+        .metrics = prom_cpu, .views = cpu_views,
+        .dirty = RESP_BIT(RESP_ROOT),
+    }, {
+        .name = "load", .interval = LOAD_INTERVAL,
+        .sample = get_loadavg, .publish = load_publish,
+        .metrics = prom_load, .views = load_views,
+        .dirty = RESP_BIT(RESP_ROOT),
+    }, {
+        .name = "meminfo", .interval = MEM_INTERVAL,
+        .sample = get_meminfo, .publish = mem_publish,
+        .metrics = prom_mem, .views = mem_views,
+        .dirty = RESP_BIT(RESP_ROOT),
+    }, {
+        .name = "net", .interval = NET_INTERVAL, .init = net_init,
+        .sample = net_sample, .publish = net_publish, .event = net_event,
+        .metrics = prom_net, .views = net_views,
+        .dirty = RESP_BIT(RESP_ROOT),
+    }, {
+        .name = "disk", .interval = DISK_INTERVAL,
+        .sample = get_diskstats, .publish = disk_publish,
+        .metrics = prom_disk, .views = disk_views,
+    }, {
+        .name = "fs", .interval = FS_INTERVAL, .init = fs_init,
+        .sample = get_fs, .publish = fs_publish, .event = fs_event,
+        .metrics = prom_fs, .views = fs_views,
+    }, {
+        .name = "pressure", .interval = PSI_INTERVAL, .init = psi_init,
+        .sample = psi_sample, .publish = psi_publish, .event = psi_event,
+        .metrics = prom_psi, .views = psi_views,
+    }, {
+        .name = "top", .interval = TOP_INTERVAL, .init = top_init,
+        .sample = get_top, .publish = top_publish, .views = top_views,
+    }, {
+        .name = "cgroups", .interval = CG_INTERVAL, .init = cg_init,
+        .sample = cg_sample, .publish = cg_publish,
+        .event = cg_event, .views = cg_views,
+    },
+};
+
+#define NCOLLECTORS (sizeof (collectors) / sizeof (collectors[0]))
+
+/**
+ * collector_find - look up a collector by name
+ */
+static gimli_collector_t *
+collector_find(const char *name, size_t len)
+{
+    for (unsigned i = 0; i < NCOLLECTORS; i++) {
+        if (strncmp(collectors[i].name, name, len) == 0 &&
+                collectors[i].name[len] == '\0') {
+            return (&collectors[i]);
+        }
+    }
+    return (NULL);
+}
+
+/**
+ * render_metrics - render everything in the Prometheus text format
+ *
+ * The parts of the collectors that are enabled, in registry order.
+ */
+static void
+render_metrics(gimli_str_t *out)
+{
+    for (unsigned i = 0; i < NCOLLECTORS; i++) {
+        if (collectors[i].metrics && !collectors[i].off &&
+                !collectors[i].disabled) {
+            collectors[i].metrics(out);
+        }
+    }
+}
+
+/**
+ * collector_json - append a collector's state as a JSON object
+ */
+static void
+collector_json(gimli_str_t *out, const gimli_collector_t *c)
+{
+    str_printf(out, "{\"name\":\"%s\",\"enabled\":%s,\"available\":%s,"
+            "\"interval\":%u,\"cost_us\":%u}", c->name,
+            c->disabled ? "false" : "true", c->off ? "false" : "true",
+            c->interval, (unsigned) c->cost);
+}
+
+/**
+ * handle_collectors - list the collectors and what they cost
+ */
+static gimli_buf_t *
+handle_collectors(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+
+    str_printf(&out, "{\"collectors\":[");
+    for (unsigned i = 0; i < NCOLLECTORS; i++) {
+        if (i) str_printf(&out, ",");
+        collector_json(&out, &collectors[i]);
+    }
+    str_printf(&out, "]}\r\n");
+    b = out.buf ? resp_new(200, HTTP_JSON, out.buf, out.len) : NULL;
+    free(out.buf);
+    return (b);
+}
+
+/**
+ * conn_local - tell if the peer of a connection is on the loopback
+ */
+static int
+conn_local(const gimli_conn_t *conn)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof (ss);
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) &ss;
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) &ss;
+
+    if (getpeername(conn->fd, (struct sockaddr *) &ss, &len) != 0) {
+        return (0);
+    }
+    if (ss.ss_family == AF_INET) {
+        return ((ntohl(sin->sin_addr.s_addr) >> 24) == 127);
+    }
+    if (ss.ss_family == AF_INET6) {
+        return (IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr) ||
+                (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr) &&
+                 sin6->sin6_addr.s6_addr[12] == 127));
+    }
+    return (0);
+}
+
+/**
+ * handle_collector - POST /collectors/NAME/enable or .../disable
+ *
+ * A disabled collector is not sampled, its views answer 503 and its
+ * part of /metrics is left out, until it is enabled again. Only
+ * clients on the loopback may do this, anyone else gets 403.
+ */
+static gimli_buf_t *
+handle_collector(gimli_conn_t *conn, const gimli_http_t *req)
+{
+    const char *name = req->path + strlen("/collectors/");
+    const char *verb = strrchr(req->path, '/') + 1;
+    gimli_collector_t *c;
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+
+    if (!conn_local(conn)) {
+        return (resp_error(403));
+    }
+    // The routes only exist for known collectors.
+    c = collector_find(name, verb - 1 - name);
+    c->disabled = strcmp(verb, "disable") == 0;
+    sched_wake();
+
+    collector_json(&out, c);
+    str_printf(&out, "\r\n");
+    b = out.buf ? resp_new(200, HTTP_JSON, out.buf, out.len) : NULL;
+    free(out.buf);
+    return (b);
+}
+
+/**
+ * collectors_register - give the views of the collectors their routes
+ *
+ * Cached views get a response slot each, so a collector's publish only
+ * renders what it feeds. Every collector also gets its enable and
+ * disable routes, which are not tied to it so they work while it is
+ * disabled.
+ */
+static void
+collectors_register(void)
+{
+    static const char *const verbs[] = { "enable", "disable" };
+    unsigned nroutes = sizeof (routes) / sizeof (routes[0]), n, resp;
+    gimli_route_t *all, *r;
+    const gimli_view_t *v;
+    gimli_collector_t *c;
+
+    if (NCOLLECTORS > STREAM_MAXCOLL) {
+        printf("collectors_register: more than %d collectors\n",
+                STREAM_MAXCOLL);
+        exit(1);
+    }
+    n = nroutes + 1 + NCOLLECTORS * 2;
+    for (c = collectors; c < collectors + NCOLLECTORS; c++) {
+        for (v = c->views; v->path; v++) n++;
+    }
+    if ((all = calloc(n, sizeof (*all))) == NULL) {
+        printf("collectors_register: out of memory\n");
+        exit(1);
+    }
+    memcpy(all, routes, sizeof (routes));
+    r = all + nroutes;
+    *r++ = (gimli_route_t) { "/collectors", HTTP_GET, RESP_NR,
+        handle_collectors, NULL };
+
+    resp = RESP_VIEWS;
+    for (c = collectors; c < collectors + NCOLLECTORS; c++) {
+        for (v = c->views; v->path; v++, r++) {
+            *r = (gimli_route_t) { v->path, HTTP_GET, RESP_NR, v->handler,
+                c };
+            if (v->render == NULL) continue;
+            if (resp == RESP_NR) {
+                printf("collectors_register: more than %d views\n",
+                        RESP_NR - RESP_VIEWS);
+                exit(1);
+            }
+            renderers[resp].render = v->render;
+            r->resp = resp;
+            c->resp |= RESP_BIT(resp);
+            resp++;
+        }
+        for (int k = 0; k < 2; k++, r++) {
+            char *path;
+
+            if (asprintf(&path, "/collectors/%s/%s", c->name,
+                        verbs[k]) < 0) {
+                printf("collectors_register: out of memory\n");
+                exit(1);
+            }
+            *r = (gimli_route_t) { path, HTTP_POST, RESP_NR,
+                handle_collector, NULL };
+        }
+    }
+    router_init(all, n);
+}
+
+/*
+ * Server-sent events on /stream, and the same events over WebSockets
+ * on /ws. Whenever a collector publishes something new, the scheduler
+ * turns its main view into one buffer per kind of event and wakes the
+ * loops that have subscribers; each loop then queues a reference to
+ * that same buffer on every connection that follows the collector.
+ * A subscriber that cannot keep up just has its queue fill, and skips
+ * to the latest event once there is room again.
+ */
+
+/**
+ * stream_wake - have a loop look at its subscribers again
+ */
+static void
+stream_wake(gimli_loop_t *loop)
+{
+    uint64_t one = 1;
+
+    if (write(loop->wake.fd, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+        printf("stream_wake: %s\n", strerror(errno));
+    }
+}
+
+static gimli_buf_t *ws_frame(int op, const char *data, size_t len);
+
+/* Ids of /stream and /ws events, shared by all collectors. */
+static unsigned long long stream_ids;
+
+/**
+ * stream_publish - make the events of a collector that just published
+ *
+ * The events carry the body of the collector's first cached view, from
+ * the cache, with the whitespace outside strings squeezed out so it
+ * fits on one data line. If that is what the last events carried, there
+ * is nothing to send.
+ */
+static void
+stream_publish(gimli_collector_t *c)
+{
+    static gimli_str_t json, msg;
+    gimli_buf_t *view, *sse, *ws, *old, *oldws;
+    gimli_loop_t *loops;
+    const char *p;
+    char head[64], *q;
+    unsigned long long id;
+    unsigned seq;
+    int n, instr = 0;
+
+    if (c->resp == 0 || (view = cache_get(__builtin_ctz(c->resp))) == NULL) {
+        return;
+    }
+    p = memmem(view->data, view->len, "\r\n\r\n", 4) + 4;
+    json.len = 0;
+    str_printf(&json, "%.*s", (int) (view->data + view->len - p), p);
+    buf_unref(view);
+
+    for (p = q = json.buf; p < json.buf + json.len; p++) {
+        if (instr) {
+            if (*p == '\\' && p + 1 < json.buf + json.len) {
+                *q++ = *p++;
+            } else if (*p == '"') {
+                instr = 0;
+            }
+        } else if (*p == '"') {
+            instr = 1;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            continue;
+        }
+        *q++ = *p;
+    }
+    json.len = q - json.buf;
+    json.buf[json.len] = '\0';
+
+    // Only this thread replaces c->sse, so it cannot go away here.
+    if ((old = atomic_load(&c->sse)) != NULL && old->len >= json.len + 8 &&
+            memcmp(old->data + old->len - json.len - 8, "data: ", 6) == 0 &&
+            memcmp(old->data + old->len - json.len - 2, json.buf,
+                json.len) == 0) {
+        return;
+    }
+
+    // Ids only grow across collectors, so Last-Event-ID means something.
+    id = ++stream_ids;
+    n = snprintf(head, sizeof (head), "id: %llu\nevent: %s\ndata: ", id,
+            c->name);
+    if ((sse = buf_alloc(n + json.len + 2)) == NULL) return;
+    memcpy(sse->data, head, n);
+    memcpy(sse->data + n, json.buf, json.len);
+    memcpy(sse->data + n + json.len, "\n\n", 2);
 
+    msg.len = 0;
+    str_printf(&msg, "{\"event\":\"%s\",\"id\":%llu,\"data\":%s}",
+            c->name, id, json.buf);
+    if ((ws = ws_frame(WS_TEXT, msg.buf, msg.len)) == NULL) {
+        buf_unref(sse);
+        return;
+    }
+
+    seq = atomic_load(&c->evseq);
+    atomic_store(&c->evseq, seq + 1);
+    old = atomic_exchange(&c->sse, sse);
+    oldws = atomic_exchange(&c->ws, ws);
+    atomic_store(&c->evid, id);
+    atomic_store(&c->evseq, seq + 2);
+    cache_retire(old);
+    cache_retire(oldws);
+
+    if (atomic_load(&server.streams) == 0) return;
+    loops = atomic_load(&server.loop);
+    for (unsigned i = 0; i < server.loops; i++) {
+        if (atomic_load(&loops[i].nsubs) > 0) {
+            stream_wake(&loops[i]);
+        }
+    }
+}
 
 /**
- * get_cpu_util - get total CPU util from kernel
- *
- * Samples the first line of /proc/stat twice and saves
- * columns 2-5 (skipping the first column 'cpu') two times
- * and saves calculated percentage results in gimli.cpu_util.
- *
- * The values for columns 2-5 in /proc/stat are as follows:
- *
- *     user, nice, system, idle, iowait
- *
- * More info about these values can be found in proc(5).
+ * stream_send - queue the events a subscriber has not seen yet
  *
+ * Events go out in id order, so ids never go backwards on a stream.
+ * Returns the mono ms at which events held back by the interval may go,
+ * or 0 if there are none; events that did not fit in the queue go once
+ * the socket drains, see conn_writable(). May close the connection.
  */
-static status_t
-get_cpu_util(gimli_t *gimli)
+static int64_t
+stream_send(gimli_conn_t *conn, int64_t now)
 {
-    FILE          *f;
-    char           buf[256];
-    long double    tot = 0;
-    gimli_cpu_t    old = {0}, new = {0}, diff = {0};
+    struct {
+        unsigned long long id;
+        gimli_buf_t   *buf;
+        unsigned       coll;
+        unsigned       seq;
+    } ev[STREAM_MAXCOLL], tmp;
+    gimli_sub_t *sub = conn->sub;
+    gimli_collector_t *c;
+    unsigned i, j, n = 0, sent = 0;
+    int held = 0;
 
-    // First poll.
-    if ((f = fopen(PROC_STAT, "r")) == NULL) return (G_FAIL);
-    if (fgets(buf, sizeof (buf), f) == NULL) return (G_FAIL);
-    if (sscanf(buf, CPU_FMT, &old.u, &old.n, &old.s, &old.i, &old.w) < 4)
-        return (G_FAIL);
-    rewind(f);
-    fflush(f);
+    if (conn->closing) return (0);
+    for (i = 0; i < NCOLLECTORS; i++) {
+        c = &collectors[i];
+        if (!(sub->mask & 1u << i) ||
+                atomic_load(&c->evseq) == sub->seen[i]) {
+            continue;
+        }
+        if (now < sub->due) {
+            held = 1;
+            continue;
+        }
 
-    usleep(3000000); // wait 3 seconds
+        // Take the event that goes with seq, see stream_publish().
+        do {
+            ev[n].seq = atomic_load(&c->evseq);
+            ev[n].buf = atomic_load(sub->ws ? &c->ws : &c->sse);
+            ev[n].id = atomic_load(&c->evid);
+        } while ((ev[n].seq & 1) || ev[n].seq != atomic_load(&c->evseq));
+        ev[n].coll = i;
+        if (ev[n].buf != NULL) n++;
+    }
 
-    // Second poll.
-    if (fgets(buf, sizeof (buf), f) == NULL) return (G_FAIL);
-    if (sscanf(buf, CPU_FMT, &new.u, &new.n, &new.s, &new.i, &new.w) < 4)
-        return (G_FAIL);
-    if (fclose(f) != 0) return (G_FAIL);
-
-    // Calculate diffs.
-    diff.u = new.u > old.u ? new.u - old.u : old.u - new.u;
-    diff.n = new.n > old.n ? new.n - old.n : old.n - new.n;
-    diff.s = new.s > old.s ? new.s - old.s : old.s - new.s;
-    diff.i = new.i > old.i ? new.i - old.i : old.i - new.i;
-    diff.w = new.w > old.w ? new.w - old.w : old.w - new.w;
-    tot = diff.u + diff.n + diff.s + diff.i + diff.w;
-
-    // Calculate final percentages
-    gimli->cpu[CPU_USER] = (diff.u / tot) * 100;
-    gimli->cpu[CPU_NICE] = (diff.n / tot) * 100;
-    gimli->cpu[CPU_SYSTEM] = (diff.s / tot) * 100;
-    gimli->cpu[CPU_IDLE] = (diff.i / tot) * 100;
-    gimli->cpu[CPU_IOWAIT] = (diff.w / tot) * 100;
+    // Only a few collectors, insertion sort by id.
+    for (i = 1; i < n; i++) {
+        tmp = ev[i];
+        for (j = i; j > 0 && ev[j - 1].id > tmp.id; j--) ev[j] = ev[j - 1];
+        ev[j] = tmp;
+    }
+    for (i = 0; i < n && conn->outcnt < CONN_OUTQ; i++) {
+        conn_queue(conn, buf_ref(ev[i].buf));
+        sub->seen[ev[i].coll] = ev[i].seq;
+        sent++;
+    }
+    if (sent > 0) {
+        sub->due = now + sub->interval;
+        if (conn_send(conn) != G_OK) return (0);
+    }
+    return (held ? sub->due : 0);
+}
 
-    return (G_OK);
+/**
+ * stream_flush - send on new events to every subscriber of a loop
+ */
+static void
+stream_flush(gimli_loop_t *loop)
+{
+    int64_t now = mono_ms();
+    gimli_sub_t *sub, *next;
+
+    loop->due = 0;
+    for (sub = loop->subs; sub != NULL; sub = next) {
+        // Sending may close the connection, and free sub with it.
+        next = sub->next;
+        stream_due(loop, stream_send(sub->conn, now));
+    }
 }
 
 /**
- * get_loadavg - sample /proc/loadavg for loadavg
- *
- * Save the first three values from /proc/loadavg:
- *
- *    1) load avg of last 1 minute
- *    2) load avg of last 5 minutes
- *    3) load avg of last 15 minutes
- *
- * More info about these values can be found in proc(5).
+ * stream_mask - the collectors in a comma separated list of names
  *
+ * Only collectors with a cached view have events.
  */
 static status_t
-get_loadavg(gimli_t *gimli)
+stream_mask(const char *names, unsigned *mask)
 {
-    FILE          *f;
-    char           buf[256];
+    const char *p, *end;
+    gimli_collector_t *c;
 
-    // Read first line of /proc/loadavg and get first 3 values.
-    if ((f = fopen(PROC_LOADAVG, "r")) == NULL) return (G_FAIL);
-    if (fgets(buf, sizeof (buf), f) == NULL) return (G_FAIL);
-    if (sscanf(buf, LOAD_FMT, &gimli->load[0], &gimli->load[1],
-                &gimli->load[2]) < 2) {
-        return (G_FAIL);
+    *mask = 0;
+    for (p = names; *p != '\0'; p = *end ? end + 1 : end) {
+        if ((end = strchr(p, ',')) == NULL) end = p + strlen(p);
+        c = collector_find(p, end - p);
+        if (c == NULL || c->resp == 0) return (G_FAIL);
+        *mask |= 1u << (c - collectors);
     }
-    if (fclose(f) != 0) return (G_FAIL);
     return (G_OK);
 }
 
 /**
- * get_meminfo - get system memory info
+ * stream_sub - make a connection a subscriber of its loop
  *
- * Gathers various memory data from sysinfo() library
- * function and sets the gimli_t struct fields.
- *
- * For more info on memory fields, see sysinfo(2).
+ * The current events of the collectors go out with the next flush.
  */
 static status_t
-get_meminfo(gimli_t *gimli)
+stream_sub(gimli_conn_t *conn, unsigned mask, unsigned interval, int ws)
 {
-   struct sysinfo meminfo;
-
-   if (sysinfo(&meminfo) < 0) {
-       return (G_FAIL);
-   }
+    gimli_loop_t *loop = conn->loop;
+    gimli_sub_t *sub;
 
-   gimli->meminfo[TOTAL_RAM]  = (meminfo.totalram * meminfo.mem_unit) / 1024;
-   gimli->meminfo[FREE_RAM]   = (meminfo.freeram * meminfo.mem_unit) / 1024;
-   gimli->meminfo[SHARED_RAM] = (meminfo.sharedram * meminfo.mem_unit) / 1024;
-   gimli->meminfo[BUFFER_RAM] = (meminfo.bufferram * meminfo.mem_unit) / 1024;
-   gimli->meminfo[TOTAL_SWAP] = (meminfo.totalswap * meminfo.mem_unit) / 1024;
-   gimli->meminfo[FREE_SWAP]  = (meminfo.freeswap * meminfo.mem_unit) / 1024;
-   gimli->meminfo[TOTAL_HIGH] = (meminfo.totalhigh * meminfo.mem_unit) / 1024;
-   gimli->meminfo[FREE_HIGH]  = (meminfo.freehigh * meminfo.mem_unit) / 1024;
-   gimli->meminfo[MEM_UNIT]   = meminfo.mem_unit;
-   gimli->procs = meminfo.procs;
-   gimli->uptime = meminfo.uptime;
-
-   return (G_OK);
+    if ((sub = calloc(1, sizeof (*sub))) == NULL) return (G_FAIL);
+    sub->conn = conn;
+    sub->mask = mask;
+    sub->interval = interval;
+    sub->ws = ws;
+    if ((sub->next = loop->subs) != NULL) sub->next->prev = sub;
+    loop->subs = sub;
+    conn->sub = sub;
+    atomic_fetch_add(&loop->nsubs, 1);
+    atomic_fetch_add(&server.streams, 1);
+    stream_wake(loop);
+    return (G_OK);
 }
 
 /**
- * get_netif - get network interface information
+ * handle_stream - follow collectors as server-sent events
  *
- * Detects all network interfaces and their addresses and Rx/Tx data
+ * /stream[?metrics=NAME,...][&interval=MS] keeps the connection open
+ * and sends an event named after the collector every time one of those
+ * named (all by default) publishes something new, starting with what
+ * they last did. With an interval, events come no more often than
+ * every MS.
  */
-static status_t
-get_netif(gimli_t *gimli)
+static gimli_buf_t *
+handle_stream(gimli_conn_t *conn, const gimli_http_t *req)
 {
-    struct ifaddrs *ifaddr, *ifa;
-    int family, s;
-    char ipv4[NI_MAXHOST];
+    gimli_buf_t *b;
+    char val[HTTP_QUERYSIZ], *end;
+    unsigned mask = 0;
+    long interval = 0;
 
-    if (getifaddrs(&ifaddr) == -1) {
-        printf("getifaddrs failed\n");
-        return (G_FAIL);
-    }
-
-    gimli->netifs = 0;
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET) {
-            family = ifa->ifa_addr->sa_family;
-            sprintf(gimli->net[gimli->netifs].ifname, "%s", ifa->ifa_name);
-            s = getnameinfo(ifa->ifa_addr,
-                    (family == AF_INET) ? sizeof(struct sockaddr_in) :
-                    sizeof(struct sockaddr_in6),
-                    ipv4, NI_MAXHOST,
-                    NULL, 0, NI_NUMERICHOST);
-            if (s != 0) {
-                printf("getnameinfo failed: %s\n", gai_strerror(s));
-                return (G_FAIL);
-            }
-            sprintf(gimli->net[gimli->netifs].ipv4, "%s", ipv4);
-            gimli->netifs++;
+    if (query_get(req, "metrics", val, sizeof (val))) {
+        if (stream_mask(val, &mask) != G_OK) return (resp_error(400));
+    } else {
+        for (unsigned i = 0; i < NCOLLECTORS; i++) {
+            if (collectors[i].resp != 0) mask |= 1u << i;
         }
-        /*
-        if (family == AF_PACKET && ifa->ifa_data != NULL) {
-            struct rtnl_link_stats *stats = ifa->ifa_data;
-
-            gimli->net[n].tx_packets = stats->tx_packets;
-            gimli->net[n].rx_packets = stats->rx_packets;
-            gimli->net[n].tx_bytes = stats->tx_bytes;
-            gimli->net[n].rx_bytes = stats->rx_bytes;
+    }
+    if (query_get(req, "interval", val, sizeof (val))) {
+        interval = strtol(val, &end, 10);
+        if (*val == '\0' || *end != '\0' || interval < 0 ||
+                interval > SCHED_MAXINTERVAL) {
+            return (resp_error(400));
         }
-        */
     }
 
-    freeifaddrs(ifaddr);
-    return (G_OK);
+    if ((b = buf_alloc(sizeof (STREAM_HDR) - 1)) == NULL) return (NULL);
+    memcpy(b->data, STREAM_HDR, b->len);
+    if (stream_sub(conn, mask, interval, 0) != G_OK) {
+        buf_unref(b);
+        return (NULL);
+    }
+    return (b);
 }
 
-static void *
-thread_create_detached(void *(*func) (void *), void *arg)
-{
-    pthread_t tid;
-    pthread_attr_t attr;
+/*
+ * WebSockets (RFC 6455) on /ws. After the upgrade the client follows
+ * nothing; it sends text commands, one per message:
+ *
+ *   sub NAME[,NAME...]     follow these collectors too
+ *   unsub NAME[,NAME...]   stop following them
+ *   interval MS            events no more often than every MS
+ *
+ * and is answered with its subscription, or an error, as JSON. Events
+ * are text messages like {"event":"cpu","id":7,"data":{...}}, sent
+ * like those of /stream.
+ */
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_create(&tid, &attr, func, arg);
-    return (void *) {0};
+static uint32_t
+rol32(uint32_t v, int n)
+{
+    return (v << n | v >> (32 - n));
 }
 
+/**
+ * sha1_block - run SHA-1 over one 64 byte block
+ */
 static void
-handle_request(const char *buf, char *output, size_t size)
-{
-    if (strncmp(buf, "GET /cpu", sizeof ("GET /cpu") - 2) == 0) {
-        snprintf(output, size,
-                "{" \
-                    "\"cpu\":{" \
-                        "\"us\":%.1Lf," \
-                        "\"sy\":%.1Lf," \
-                        "\"id\":%.1Lf," \
-                        "\"wa\":%.1Lf," \
-                        "\"ni\":%.1Lf" \
-                    "}" \
-                "}\r\n",
-                gimli.cpu[CPU_USER], gimli.cpu[CPU_SYSTEM],
-                gimli.cpu[CPU_IDLE], gimli.cpu[CPU_IOWAIT],
-                gimli.cpu[CPU_NICE]);
-    } else if (strncmp(buf, "GET /load", sizeof ("GET /load") - 2) == 0) {
-        snprintf(output, size,
-                "{" \
-                    "\"load\":[%.2f, %.2f, %.2f]" \
-                "}\r\n",
-                gimli.load[LOAD_ONE], gimli.load[LOAD_FIVE],
-                gimli.load[LOAD_FIFTEEN]);
-    } else if (strncmp(buf, "GET /uptime", sizeof ("GET /uptime") - 2) == 0) {
-        snprintf(output, size,
-                "{" \
-                    "\"uptime\":[%lu, %01lu, %02lu]" \
-                "}\r\n",
-                gimli.uptime/86400, gimli.uptime/3600%24, gimli.uptime/60%60);
-    } else if (strncmp(buf, "GET /procs", sizeof ("GET /procs") - 2) == 0) {
-        snprintf(output, size,
-                "{" \
-                    "\"procs\":%hu" \
-                "}\r\n",
-                gimli.procs);
-    } else if (strncmp(buf, "GET /cores", sizeof ("GET /cores") - 2) == 0) {
-        snprintf(output, size,
-                "{" \
-                    "\"cores\":%d" \
-                "}\r\n",
-                gimli.cores);
-    } else if (strncmp(buf, "GET /net", sizeof ("GET /net") - 2) == 0) {
-        snprintf(output, size, "{\"netifs\":[");
-        for (int i=0; i<gimli.netifs; i++) {
-            sprintf(output+strlen(output), IFNAME_JSON, gimli.net[i].ifname,
-                    gimli.net[i].ipv4);
-            if (i+1 < gimli.netifs) {
-                sprintf(output+strlen(output), ",");
-            }
-        }
-        sprintf(output+strlen(output), "]}\r\n");
-    } else if (strncmp(buf, "GET / HTTP", sizeof ("GET / HTTP") - 2) == 0) {
-        snprintf(output, size,
-                "{\n" \
-                "    \"cpu\": {\n" \
-                "        \"us\": %.1Lf,\n" \
-                "        \"sy\": %.1Lf,\n" \
-                "        \"id\": %.1Lf,\n" \
-                "        \"wa\": %.1Lf,\n" \
-                "        \"ni\": %.1Lf\n" \
-                "    },\n" \
-                "    \"load\": [%.2f, %.2f, %.2f],\n" \
-                "    \"uptime\": [%lu, %01lu, %02lu],\n" \
-                "    \"procs\": %hu,\n" \
-                "    \"cores\": %d,\n",
-                gimli.cpu[CPU_USER], gimli.cpu[CPU_SYSTEM],
-                gimli.cpu[CPU_IDLE], gimli.cpu[CPU_IOWAIT],
-                gimli.cpu[CPU_NICE], gimli.load[LOAD_ONE],
-                gimli.load[LOAD_FIVE], gimli.load[LOAD_FIFTEEN],
-                gimli.uptime/86400, gimli.uptime/3600%24, gimli.uptime/60%60,
-                gimli.procs, gimli.cores);
-        snprintf(output+strlen(output), size, "    \"netifs\": [");
-        for (int i=0; i<gimli.netifs; i++) {
-            if (i==0) {
-                sprintf(output+strlen(output), IFNAME_PRETTY_FIRST_JSON,
-                        gimli.net[i].ifname, gimli.net[i].ipv4);
-            } else {
-                sprintf(output+strlen(output), IFNAME_PRETTY_JSON,
-                        gimli.net[i].ifname, gimli.net[i].ipv4);
-            }
-            if (i+1 < gimli.netifs) {
-                sprintf(output+strlen(output), ", ");
-            }
+sha1_block(uint32_t h[5], const unsigned char *p)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+            (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
         }
-        sprintf(output+strlen(output), "]\n}\r\n");
-    } else {
-        snprintf(output, size, "{\"err\": 1}\r\n");
+        t = rol32(a, 5) + f + e + k + w[i];
+        e = d, d = c, c = rol32(b, 30), b = a, a = t;
     }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
 }
 
-static void *
-handle_connection(void *arg)
+/**
+ * sha1 - SHA-1 digest of len bytes, only for the WebSocket handshake
+ */
+static void
+sha1(const void *data, size_t len, unsigned char digest[20])
 {
-    int fd, len;
-    char buf[1024];
-    char output[2048] = {0};
-    size_t size = sizeof (output);
-
-    fd = *((int *) arg);
-    len = recv(fd, buf, sizeof (buf), 0);
-    if (len <= 0) {
-        // Connection lost, gracefully exit.
-        return (void *) {0};
-    }
+    uint32_t h[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+    };
+    const unsigned char *p = data;
+    unsigned char block[64];
+    uint64_t bits = (uint64_t) len * 8;
+    size_t n;
 
-    // Trim trailing newline.
-    if (buf[len-1] == '\n') {
-        buf[len-1] = '\0';
-    } else {
-        buf[len] = '\0';
-    }
+    for (; len >= 64; p += 64, len -= 64) sha1_block(h, p);
 
-    printf("%s\n", buf);
-    snprintf(output, size,
-            "HTTP/1.1 200 OK\r\n" \
-            "Content-Type: application/json; charset=utf-8\r\n" \
-            "\r\n");
-    if (send(fd, output, strlen(output), MSG_NOSIGNAL) <= 0) {
-        return (void *) {0};
-    }
-    handle_request(buf, output, size);
-    if (send(fd, output, strlen(output), MSG_NOSIGNAL) <= 0) {
-        return (void *) {0};
-    }
-    if (fd > 0) {
-        shutdown(fd, SHUT_RDWR);
-        close(fd);
+    // The rest, a one bit, zeros and the length in bits.
+    memset(block, 0, sizeof (block));
+    memcpy(block, p, len);
+    block[len] = 0x80;
+    if (len >= 56) {
+        sha1_block(h, block);
+        memset(block, 0, sizeof (block));
     }
+    for (n = 0; n < 8; n++) block[63 - n] = bits >> (8 * n);
+    sha1_block(h, block);
 
-    return (void *) {0};
+    for (n = 0; n < 20; n++) digest[n] = h[n / 4] >> (24 - 8 * (n % 4));
 }
 
-static void *
-handle_connections()
+/**
+ * base64 - encode len bytes, out must have room for 4 * ((len + 2) / 3) + 1
+ */
+static void
+base64(const unsigned char *in, size_t len, char *out)
 {
-    int fd, newfd;
-    struct sockaddr_in svr_addr, peer_addr;
-    socklen_t peer_addr_size;
+    static const char tab[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t v;
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd == -1) {
-        printf("Couldn't create socket: %m\n");
-        exit(1);
-    }
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 },
-                sizeof (int)) < 0) {
-        printf("setsockopt(SO_REUSEADDR) failed\n");
-        exit(1);
+    for (size_t i = 0; i < len; i += 3) {
+        v = (uint32_t) in[i] << 16;
+        if (i + 1 < len) v |= (uint32_t) in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        *out++ = tab[v >> 18 & 63];
+        *out++ = tab[v >> 12 & 63];
+        *out++ = i + 1 < len ? tab[v >> 6 & 63] : '=';
+        *out++ = i + 2 < len ? tab[v & 63] : '=';
     }
+    *out = '\0';
+}
 
-    memset(&svr_addr, 0, sizeof(struct sockaddr_in));
-    svr_addr.sin_addr.s_addr = INADDR_ANY;
-    svr_addr.sin_family = AF_INET;
-    svr_addr.sin_port = htons(SERVER_PORT);
+/**
+ * ws_frame - make an unmasked, unfragmented frame around data
+ */
+static gimli_buf_t *
+ws_frame(int op, const char *data, size_t len)
+{
+    unsigned char hdr[10];
+    gimli_buf_t *b;
+    size_t n = 2;
 
-    if (bind(fd, (struct sockaddr *) &svr_addr,
-                sizeof(struct sockaddr_in)) == -1) {
-        printf("Couldn't bind to socket: %m\n");
-        close(fd);
-        exit(1);
+    hdr[0] = 0x80 | op;
+    if (len < 126) {
+        hdr[1] = len;
+    } else if (len < 65536) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        n = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i = 0; i < 8; i++) hdr[2 + i] = (uint64_t) len >> (56 - 8 * i);
+        n = 10;
     }
+    if ((b = buf_alloc(n + len)) == NULL) return (NULL);
+    memcpy(b->data, hdr, n);
+    memcpy(b->data + n, data, len);
+    return (b);
+}
 
-    /* Listen on specified port. */
-    if (listen(fd, 5) == -1) {
-        printf("Couldn't listen to port: %m\n");
-        close(fd);
-        exit(1);
+/**
+ * ws_close - send a close frame with code, and close once it is out
+ */
+static void
+ws_close(gimli_conn_t *conn, int code)
+{
+    char payload[2] = { code >> 8, code & 0xff };
+    gimli_buf_t *b;
+
+    if ((b = ws_frame(WS_CLOSE, payload, sizeof (payload))) != NULL) {
+        conn_queue(conn, b);
     }
-    printf("Listening at: 127.0.0.1:%d (%d)\n", SERVER_PORT, (int) getpid());
+    conn->closing = 1;
+}
+
+/**
+ * ws_command - act on a command from a client and answer it
+ */
+static void
+ws_command(gimli_conn_t *conn, const char *msg, size_t len)
+{
+    gimli_sub_t *sub = conn->sub;
+    gimli_str_t out = {0};
+    gimli_buf_t *b;
+    char cmd[WS_CMDSIZ], *arg, *end;
+    const char *err = NULL;
+    unsigned mask;
+    long val;
+
+    snprintf(cmd, sizeof (cmd), "%.*s", (int) len, msg);
+    if ((arg = strchr(cmd, ' ')) != NULL) *arg++ = '\0';
 
-    /* Accept connections. */
-    peer_addr_size = sizeof(struct sockaddr_in);
-    while ((newfd = accept(fd, (struct sockaddr *) &peer_addr,
-                    &peer_addr_size))) {
-        if (newfd != -1) {
-            printf("Incoming connection from %s:%d, fd=%d\n",
-                    inet_ntoa(peer_addr.sin_addr), ntohs(peer_addr.sin_port),
-                    newfd);
-            int localfd = newfd;
-            thread_create_detached(&handle_connection, (void *) &localfd);
+    if (len >= sizeof (cmd) || arg == NULL) {
+        err = "usage: sub|unsub NAME[,NAME...] or interval MS";
+    } else if (strcmp(cmd, "sub") == 0 || strcmp(cmd, "unsub") == 0) {
+        if (stream_mask(arg, &mask) != G_OK) {
+            err = "no such collector";
+        } else if (cmd[0] == 's') {
+            // Newly followed collectors start with their last event.
+            for (unsigned i = 0; i < NCOLLECTORS; i++) {
+                if (mask & ~sub->mask & 1u << i) sub->seen[i] = 0;
+            }
+            sub->mask |= mask;
+        } else {
+            sub->mask &= ~mask;
         }
+    } else if (strcmp(cmd, "interval") == 0) {
+        val = strtol(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || val < 0 ||
+                val > SCHED_MAXINTERVAL) {
+            err = "interval must be 0-3600000 ms";
+        } else {
+            sub->interval = val;
+            sub->due = 0;
+        }
+    } else {
+        err = "usage: sub|unsub NAME[,NAME...] or interval MS";
     }
 
-    /* Never reached. */
-    close(fd);
-    return (void *) {0};
+    if (err != NULL) {
+        str_printf(&out, "{\"err\":\"%s\"}", err);
+    } else {
+        str_printf(&out, "{\"sub\":[");
+        for (unsigned i = 0, n = 0; i < NCOLLECTORS; i++) {
+            if (sub->mask & 1u << i) {
+                str_printf(&out, "%s\"%s\"", n++ ? "," : "",
+                        collectors[i].name);
+            }
+        }
+        str_printf(&out, "],\"interval\":%u}", sub->interval);
+        stream_wake(conn->loop);
+    }
+    if (out.buf != NULL && (b = ws_frame(WS_TEXT, out.buf, out.len)) != NULL) {
+        conn_queue(conn, b);
+    }
+    free(out.buf);
 }
 
-void *
-gimli_mine_cpu()
+/**
+ * ws_process - act on the complete frames from a client
+ *
+ * Returns how many bytes were used. Client frames are masked and, as
+ * commands are short, must fit in the connection's buffer and not be
+ * fragmented; anything else closes the connection. One frame is
+ * answered per free slot in the queue, the rest waits until it drains.
+ */
+static size_t
+ws_process(gimli_conn_t *conn, char *p, size_t len)
 {
-    gimli.cores = sysconf(_SC_NPROCESSORS_CONF);
-    while (1) {
-        if (get_cpu_util(&gimli) != G_OK) {
-            printf("get_cpu_util failed\n");
+    unsigned char *f;
+    size_t off = 0, hlen, plen;
+    int op;
+
+    while (!conn->closing && conn->outcnt < CONN_OUTQ && len - off >= 2) {
+        f = (unsigned char *) p + off;
+        op = f[0] & 0x0f;
+        plen = f[1] & 0x7f;
+        hlen = 2;
+        if (plen == 126) {
+            if (len - off < 4) break;
+            plen = f[2] << 8 | f[3];
+            hlen = 4;
+        } else if (plen == 127) {
+            ws_close(conn, WS_CLOSE_TOOBIG);
+            break;
+        }
+        if ((f[0] & 0x70) || !(f[1] & 0x80)) {
+            // Reserved bits set or not masked.
+            ws_close(conn, WS_CLOSE_PROTOCOL);
+            break;
+        }
+        hlen += 4;
+        if (hlen + plen > CONN_BUFSIZ) {
+            ws_close(conn, WS_CLOSE_TOOBIG);
+            break;
+        }
+        if (len - off < hlen + plen) break;
+
+        for (size_t i = 0; i < plen; i++) f[hlen + i] ^= f[hlen - 4 + i % 4];
+        off += hlen + plen;
+
+        if (!(f[0] & 0x80) && op < WS_CLOSE) {
+            ws_close(conn, WS_CLOSE_UNSUPPORTED);
+        } else if (op == WS_TEXT) {
+            ws_command(conn, (char *) f + hlen, plen);
+        } else if (op == WS_CLOSE) {
+            ws_close(conn, WS_CLOSE_NORMAL);
+        } else if (op == WS_PING) {
+            gimli_buf_t *b = ws_frame(WS_PONG, (char *) f + hlen, plen);
+
+            if (b != NULL) conn_queue(conn, b);
+        } else if (op != WS_PONG) {
+            ws_close(conn, WS_CLOSE_UNSUPPORTED);
         }
     }
+    return (off);
 }
 
-void *
-gimli_mine_load()
+/**
+ * handle_ws - upgrade to a WebSocket that follows collectors
+ */
+static gimli_buf_t *
+handle_ws(gimli_conn_t *conn, const gimli_http_t *req)
 {
-    while (1) {
-        if (get_loadavg(&gimli) != G_OK) {
-            printf("get_loadavg failed\n");
-        }
-        sleep(1);
+    char key[WS_KEYLEN + sizeof (WS_GUID)], accept[29], hdr[160];
+    unsigned char digest[20];
+    gimli_buf_t *b;
+    int n;
+
+    if (!(req->flags & HTTP_F_UPGRADE) || !(req->flags & HTTP_F_WEBSOCKET) ||
+            req->version != 11 || req->wsversion != 13) {
+        return (resp_error(426));
+    }
+    if (req->wskey[0] == '\0') {
+        return (resp_error(400));
+    }
+    n = snprintf(key, sizeof (key), "%s%s", req->wskey, WS_GUID);
+    sha1(key, n, digest);
+    base64(digest, sizeof (digest), accept);
+
+    n = snprintf(hdr, sizeof (hdr), WS_HDR, accept);
+    if ((b = buf_alloc(n)) == NULL) return (NULL);
+    memcpy(b->data, hdr, n);
+    if (stream_sub(conn, 0, 0, 1) != G_OK) {
+        buf_unref(b);
+        return (NULL);
     }
+    return (b);
 }
 
-void *
-gimli_mine_meminfo()
+/**
+ * sched_align - the first multiple of interval ms since the epoch after now
+ */
+static int64_t
+sched_align(int64_t now, unsigned interval)
 {
-    while (1) {
-        if (get_meminfo(&gimli) != G_OK) {
-            printf("get_meminfo failed\n");
-        }
-        sleep(1);
+    return ((now / interval + 1) * interval);
+}
+
+/**
+ * sched_publish - copy a collector's state into gimli and render it
+ */
+static void
+sched_publish(gimli_collector_t *c)
+{
+    gimli_write_begin();
+    c->publish(&gimli);
+    gimli_write_end(c->resp | c->dirty |
+            (c->metrics ? RESP_BIT(RESP_METRICS) : 0));
+    stream_publish(c);
+}
+
+/**
+ * sched_sample - sample and publish a collector, noting what it cost
+ */
+static void
+sched_sample(gimli_collector_t *c)
+{
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (c->sample() != G_OK) {
+        printf("gimli_sched: %s failed\n", c->name);
+    } else {
+        sched_publish(c);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->cost = (t1.tv_sec - t0.tv_sec) * MILLION +
+        (t1.tv_nsec - t0.tv_nsec) / 1000;
 }
 
+/*
+ * Every collector is sampled once at startup, then on its ticks. One
+ * whose init failed is left off. A disabled one is skipped, but its
+ * events are still taken so its state stays current; enabling it takes
+ * a sample right away. When the wall clock is set the timerfd is
+ * cancelled and everything is aligned to the new time.
+ */
 void *
-gimli_mine_netif()
+gimli_sched()
 {
+    struct epoll_event evs[SCHED_EVENTS];
+    struct itimerspec its = {0};
+    gimli_collector_t *c;
+    int64_t now, due;
+    uint64_t val;
+    int tfd, n, fd, act;
+
+    if ((sched_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (tfd = timerfd_create(CLOCK_REALTIME,
+                    TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+            (sched_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        printf("gimli_sched: %s\n", strerror(errno));
+        exit(1);
+    }
+    sched_cur = NCOLLECTORS;
+    sched_watch(tfd, EPOLLIN);
+    sched_watch(sched_wakefd, EPOLLIN);
+
+    now = now_ms();
+    for (sched_cur = 0; sched_cur < NCOLLECTORS; sched_cur++) {
+        c = &collectors[sched_cur];
+        c->off = c->init && c->init() != G_OK;
+        c->was_disabled = c->disabled;
+        c->next = now;
+    }
+
     while (1) {
-        if (get_netif(&gimli) != G_OK) {
-            printf("get_netif failed\n");
+        now = now_ms();
+        due = 0;
+        for (sched_cur = 0; sched_cur < NCOLLECTORS; sched_cur++) {
+            c = &collectors[sched_cur];
+            if (c->off) continue;
+            if (c->disabled != c->was_disabled) {
+                c->was_disabled = c->disabled;
+                if (c->was_disabled) {
+                    // Drop its part of /metrics.
+                    gimli_write_begin();
+                    gimli_write_end(RESP_BIT(RESP_METRICS));
+                } else {
+                    c->next = now;
+                }
+            }
+            if (c->next <= now) {
+                if (!c->was_disabled) sched_sample(c);
+                c->next = sched_align(now, c->interval);
+            }
+            if (due == 0 || c->next < due) due = c->next;
+        }
+        its.it_value.tv_sec = due / 1000;
+        its.it_value.tv_nsec = due % 1000 * MILLION;
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                &its, NULL);
+
+        if ((n = epoll_wait(sched_epfd, evs, SCHED_EVENTS, -1)) < 0) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            sched_cur = evs[i].data.u64 >> 32;
+            fd = (uint32_t) evs[i].data.u64;
+            if (sched_cur < NCOLLECTORS) {
+                c = &collectors[sched_cur];
+                act = c->event(fd, evs[i].events);
+                if (c->disabled) continue;
+                if (act == SCHED_SAMPLE) {
+                    sched_sample(c);
+                } else if (act == SCHED_PUBLISH) {
+                    sched_publish(c);
+                }
+            } else if (fd == sched_wakefd) {
+                read(sched_wakefd, &val, sizeof (val));
+            } else if (read(tfd, &val, sizeof (val)) < 0 &&
+                    errno == ECANCELED) {
+                now = now_ms();
+                for (unsigned k = 0; k < NCOLLECTORS; k++) {
+                    collectors[k].next = sched_align(now,
+                            collectors[k].interval);
+                }
+            }
         }
-        sleep(1);
     }
 }
 
@@ -474,30 +5767,230 @@ daemonize(void)
     // openlog ("gimli", LOG_PID, LOG_DAEMON);
 }
 
+/**
+ * cpus_parse - parse a cpu list like 0-3,6 into a set
+ */
+static status_t
+cpus_parse(const char *s, cpu_set_t *set)
+{
+    long lo, hi;
+    char *end;
+
+    CPU_ZERO(set);
+    do {
+        lo = hi = strtol(s, &end, 10);
+        if (end == s) return (G_FAIL);
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s) return (G_FAIL);
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) return (G_FAIL);
+        for (; lo <= hi; lo++) CPU_SET(lo, set);
+        s = end + 1;
+    } while (*end == ',');
+    return (*end == '\0' ? G_OK : G_FAIL);
+}
+
+/**
+ * psitrig_parse - parse a trigger like memory:some:150:1000
+ *
+ * The window must be 500 ms to 10 s, and the stall within it.
+ */
+static status_t
+psitrig_parse(const char *s, gimli_psitrig_t *t)
+{
+    unsigned long long stall, window;
+    const char *p;
+    int r, k;
+
+    for (r = 0; r < PSI_NR; r++) {
+        p = s + strlen(psi_res[r]);
+        if (strncmp(s, psi_res[r], p - s) == 0 && *p == ':') break;
+    }
+    if (r == PSI_NR) return (G_FAIL);
+    s = p + 1;
+    for (k = 0; k < PSI_NRKINDS; k++) {
+        p = s + strlen(psi_kinds[k]);
+        if (strncmp(s, psi_kinds[k], p - s) == 0 && *p == ':') break;
+    }
+    if (k == PSI_NRKINDS) return (G_FAIL);
+    if ((p = scan_u64(p + 1, &stall)) == NULL || *p != ':' ||
+            (p = scan_u64(p + 1, &window)) == NULL || *p != '\0') {
+        return (G_FAIL);
+    }
+    if (window < 500 || window > 10000 || stall < 1 || stall > window) {
+        return (G_FAIL);
+    }
+    t->res = r;
+    t->kind = k;
+    t->stall = stall;
+    t->window = window;
+    t->fd = -1;
+    return (G_OK);
+}
+
+static void
+collectors_usage(void)
+{
+    printf("gimli: collectors are");
+    for (unsigned i = 0; i < NCOLLECTORS; i++) {
+        printf(" %s", collectors[i].name);
+    }
+    printf("\n");
+    exit(1);
+}
+
+static void
+usage(void)
+{
+    printf("usage: gimli [--daemon] [--interval [collector=]ms]...\n"
+           "             [--disable collector]...\n"
+           "             [--history samples]\n"
+           "             [--listen addr[:port]]... [--threads n]\n"
+           "             [--cpus list] [--backlog n] [--partitions]\n"
+           "             [--psi-trigger res:some|full:stall_ms:window_ms]...\n");
+    exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
-    if (argc == 2) {
-        if (strcmp(argv[1], "--daemon") == 0) {
-            /* Become a daemon. */
-            daemonize();
-        } else {
-            printf("usage: gimli [--daemon]\n");
-            exit(1);
+    static const struct option opts[] = {
+        { "daemon",   no_argument,       NULL, 'd' },
+        { "interval", required_argument, NULL, 'i' },
+        { "disable",  required_argument, NULL, 'D' },
+        { "history",  required_argument, NULL, 'H' },
+        { "listen",   required_argument, NULL, 'l' },
+        { "threads",  required_argument, NULL, 't' },
+        { "cpus",     required_argument, NULL, 'c' },
+        { "backlog",  required_argument, NULL, 'b' },
+        { "partitions", no_argument,     NULL, 'p' },
+        { "psi-trigger", required_argument, NULL, 'P' },
+        { NULL,       0,                 NULL, 0   }
+    };
+    gimli_collector_t *coll;
+    char *end, *p;
+    long val;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "di:D:H:l:t:c:b:pP:", opts, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            conf.daemon = 1;
+            break;
+        case 'i':
+            // A bare number is the cpu interval, as it always was.
+            if ((p = strchr(optarg, '=')) != NULL) {
+                coll = collector_find(optarg, p - optarg);
+                p++;
+            } else {
+                coll = collector_find("cpu", 3);
+                p = optarg;
+            }
+            if (coll == NULL) collectors_usage();
+            val = strtol(p, &end, 10);
+            if (*p == '\0' || *end != '\0' || val < 10 ||
+                    val > SCHED_MAXINTERVAL) {
+                printf("gimli: interval must be 10-%d ms\n",
+                        SCHED_MAXINTERVAL);
+                exit(1);
+            }
+            coll->interval = val;
+            break;
+        case 'D':
+            if ((coll = collector_find(optarg, strlen(optarg))) == NULL) {
+                collectors_usage();
+            }
+            coll->disabled = 1;
+            break;
+        case 'H':
+            val = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || val < 1 ||
+                    val > 10 * 86400) {
+                printf("gimli: history must be 1-864000 samples\n");
+                exit(1);
+            }
+            conf.history = val;
+            break;
+        case 'l':
+            if (conf.nlisten == SERVER_LISTEN) {
+                printf("gimli: at most %d listen addresses\n", SERVER_LISTEN);
+                exit(1);
+            }
+            conf.listen[conf.nlisten++] = optarg;
+            break;
+        case 't':
+            val = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || val < 1 ||
+                    val > SERVER_MAXLOOPS) {
+                printf("gimli: threads must be 1-%d\n", SERVER_MAXLOOPS);
+                exit(1);
+            }
+            conf.threads = val;
+            break;
+        case 'c':
+            if (cpus_parse(optarg, &conf.cpus) != G_OK) {
+                printf("gimli: cpus must be a list like 0-3,6\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            val = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || val < 1 ||
+                    val > 65535) {
+                printf("gimli: backlog must be 1-65535\n");
+                exit(1);
+            }
+            conf.backlog = val;
+            break;
+        case 'p':
+            conf.partitions = 1;
+            break;
+        case 'P':
+            if (conf.npsitrig == PSI_MAXTRIG ||
+                    psitrig_parse(optarg, &conf.psitrig[conf.npsitrig])) {
+                printf("gimli: psi-trigger must be like memory:some:150:1000"
+                       ", at most %d\n", PSI_MAXTRIG);
+                exit(1);
+            }
+            // Caught here rather than by psi_init() failing to arm it.
+            if (geteuid() != 0 &&
+                    conf.psitrig[conf.npsitrig].window % PSI_USERWIN != 0) {
+                printf("gimli: psi-trigger window must be a multiple of %d ms"
+                       " unless run as root\n", PSI_USERWIN);
+                exit(1);
+            }
+            conf.npsitrig++;
+            break;
+        default:
+            usage();
         }
     }
+    if (optind != argc) usage();
+
+    if (conf.daemon) {
+        /* Become a daemon. */
+        daemonize();
+    }
+
+    collectors_register();
+    for (int i = 0; i < HIST_NR; i++) {
+        hist_init(&gimli.hist[i], conf.history);
+    }
+
+    /* Render every response once so the cache is never empty. */
+    gimli_write_begin();
+    gimli_write_end(RESP_ALL);
 
-    /* Start the mine threads to gather system information. */
-    thread_create_detached(&gimli_mine_cpu, NULL);
-    thread_create_detached(&gimli_mine_load, NULL);
-    thread_create_detached(&gimli_mine_meminfo, NULL);
-    thread_create_detached(&gimli_mine_netif, NULL);
+    /* Start the scheduler to gather system information. */
+    thread_create_detached(&gimli_sched, NULL);
 
     /* Start main program loop. */
     handle_connections();
 
     /* Never reached. */
-    if (argc == 2) {
+    if (conf.daemon) {
         closelog();
     }
     return (0);
@@ -6,31 +6,58 @@
 #ifndef GIMLI_H
 #define GIMLI_H
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sched.h>
 #include <signal.h>
+#include <getopt.h>
+#include <time.h>
 #include <syslog.h>
 #include <pthread.h>
 #include <sys/sysinfo.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <ifaddrs.h>
+#include <poll.h>
 #include <linux/if_link.h>
 #include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 
 #define PROC_STAT    "/proc/stat"
 #define PROC_LOADAVG "/proc/loadavg"
 #define PROC_UPTIME  "/proc/uptime"
+#define PROC_MEMINFO "/proc/meminfo"
+#define PROC_PRESSURE "/proc/pressure/"
+#define PROC_DIR     "/proc"
+#define PROC_DISKSTATS "/proc/diskstats"
+#define SYS_BLOCK    "/sys/class/block"
+#define PROC_MOUNTINFO "/proc/self/mountinfo"
 
 #define MILLION      1000000L
 #define BILLION      1000000000L
@@ -38,19 +65,78 @@
 // 42? Not bad for an elvish princeling.
 // I happen to be sitting comfortably at 43.
 #define SERVER_PORT  8043
+#define SERVER_LOOPS 4               // default max number of event loops
+#define SERVER_MAXLOOPS 256          // max --threads
+#define SERVER_EVENTS 64             // epoll events handled per wakeup
+#define SERVER_LISTEN 8              // max listening sockets
+
+#define CONN_BUFSIZ  4096             // bytes read from a socket at once
+#define CONN_OUTQ    16               // max pipelined responses queued
+
+#define HTTP_HDR     "HTTP/1.1 %d %s\r\n" \
+                     "Content-Type: %s\r\n" \
+                     "Content-Length: %zu\r\n" \
+                     "\r\n"
+
+#define STREAM_HDR   "HTTP/1.1 200 OK\r\n" \
+                     "Content-Type: text/event-stream\r\n" \
+                     "Cache-Control: no-cache\r\n" \
+                     "\r\n"
+#define STREAM_MAXCOLL 32             // bits in a /stream collector mask
+
+#define WS_HDR       "HTTP/1.1 101 Switching Protocols\r\n" \
+                     "Upgrade: websocket\r\n" \
+                     "Connection: Upgrade\r\n" \
+                     "Sec-WebSocket-Accept: %s\r\n" \
+                     "\r\n"
+#define WS_GUID      "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEYLEN    24               // base64 of the 16 byte nonce
+#define WS_CMDSIZ    256              // max command from a client
+
+#define HTTP_JSON    "application/json; charset=utf-8"
+#define HTTP_PROM    "text/plain; version=0.0.4; charset=utf-8"
+
+#define CPU_INTERVAL 1000             // default cpu sampling interval in ms
+#define LOAD_INTERVAL 1000            // loadavg sampling interval in ms
+#define MEM_INTERVAL 1000             // meminfo sampling interval in ms
+#define DISK_INTERVAL 1000            // diskstats sampling interval in ms
+
+#define SCHED_EVENTS 16               // epoll events handled per wakeup
+#define SCHED_MAXINTERVAL 3600000     // max --interval in ms
+
+#define HISTORY_LEN  3600             // default samples kept per metric
+
+#define PROC_BUFSIZ  4096              // initial size of a proc file buffer
 
-#define CPU_FMT      "cpu %Lu %Lu %Lu %Lu %Lu"
-#define LOAD_FMT     "%f %f %f"
+#define DISK_SECTOR  512              // /proc/diskstats sector size
+
+#define FS_INTERVAL  5000             // filesystem sampling interval in ms
+#define FS_TIMEOUT   1000             // ms in one statvfs() before it hangs
+#define FS_MAXHUNG   8                // max workers stuck in hung mounts
+#define FS_PATHSIZ   256              // published mount point and source
+#define FS_TYPESIZ   32               // published filesystem type
+
+#define PSI_INTERVAL 1000             // pressure sampling interval in ms
+#define PSI_MAXTRIG  8                // max --psi-trigger
+#define PSI_USERWIN  2000             // unprivileged trigger window unit, ms
+
+#define TOP_INTERVAL 1000             // process sampling interval in ms
+#define TOP_BUDGET   4096             // max /proc/[pid]/stat reads per interval
+#define TOP_MAX      100              // max n of /procs/top
+#define TOP_DEFAULT  10               // n of /procs/top if not given
+#define TOP_COMMSIZ  16               // TASK_COMM_LEN
+
+#define CG_INTERVAL  1000             // cgroup sampling interval in ms
+#define CG_PATHSIZ   256              // published cgroup path
+#define CG_BUFSIZ    16384            // max bytes read of a cgroup file
+#define CG_EVBUFSIZ  16384            // bytes read from inotify at once
+
+#define NET_INTERVAL 1000             // link counter dump interval in ms
+#define NL_BUFSIZ    32768            // bytes read from rtnetlink at once
+#define NL_RCVBUF    (1 << 20)        // rtnetlink socket receive buffer
 
-#define IFNAME_JSON "{\"ifname\":\"%s\",\"ipv4\":\"%s\"}"
 #define IFNAME_PRETTY_JSON          "{\n"\
-                                    "        \"ifname\": \"%s\",\n"\
-                                    "        \"ipv4\": \"%s\"\n"\
-                                    "    }"
-#define IFNAME_PRETTY_FIRST_JSON    "{\n"\
-                                    "        \"ifname\": \"%s\",\n"\
-                                    "        \"ipv4\": \"%s\"\n"\
-                                    "    }"
+                                    "        \"ifname\": "
 
 enum cpu_util {
     CPU_USER       = 0,
@@ -58,7 +144,10 @@ enum cpu_util {
     CPU_SYSTEM     = 2,
     CPU_IDLE       = 3,
     CPU_IOWAIT     = 4,
-    CPU_NRSTATS    = 5,
+    CPU_IRQ        = 5,
+    CPU_SOFTIRQ    = 6,
+    CPU_STEAL      = 7,
+    CPU_NRSTATS    = 8,
 };
 
 enum cpu_loadavg {
@@ -77,8 +166,107 @@ enum meminfo {
     FREE_SWAP      = 5,
     TOTAL_HIGH     = 6,
     FREE_HIGH      = 7,
-    MEM_UNIT       = 8,
-    MEM_NRSTATS    = 9
+    AVAIL_RAM      = 8,
+    CACHED_RAM     = 9,
+    MEM_NRSTATS    = 10
+};
+
+#define MEMINFO_KEYSIZ 32             // longest /proc/meminfo key + 1
+
+enum net_stat {
+    NET_RX_BYTES   = 0,
+    NET_TX_BYTES   = 1,
+    NET_RX_PACKETS = 2,
+    NET_TX_PACKETS = 3,
+    NET_RX_ERRORS  = 4,
+    NET_TX_ERRORS  = 5,
+    NET_RX_DROPPED = 6,
+    NET_TX_DROPPED = 7,
+    NET_NRSTATS    = 8
+};
+
+/* Resources of /proc/pressure, and their lines. */
+enum psi_res {
+    PSI_CPU        = 0,
+    PSI_MEMORY     = 1,
+    PSI_IO         = 2,
+    PSI_NR         = 3
+};
+
+enum psi_kind {
+    PSI_SOME       = 0,                       // some tasks stalled
+    PSI_FULL       = 1,                       // all non-idle tasks stalled
+    PSI_NRKINDS    = 2
+};
+
+/* What /procs/top can be sorted by. */
+enum top_key {
+    TOP_CPU        = 0,
+    TOP_RSS        = 1,
+    TOP_NRKEYS     = 2
+};
+
+/* Keys of a cgroup's cpu.stat, see cg_keys(). */
+enum cg_cpu {
+    CGCPU_USAGE      = 0,                     // usage_usec
+    CGCPU_USER       = 1,
+    CGCPU_SYSTEM     = 2,
+    CGCPU_PERIODS    = 3,                     // nr_periods
+    CGCPU_THROTTLED  = 4,                     // nr_throttled
+    CGCPU_THROTTLED_USEC = 5,
+    CGCPU_NRSTATS    = 6
+};
+
+/* Keys of a cgroup's memory.stat, in bytes but for the fault counts. */
+enum cg_mem {
+    CGMEM_ANON       = 0,
+    CGMEM_FILE       = 1,
+    CGMEM_KERNEL     = 2,
+    CGMEM_SHMEM      = 3,
+    CGMEM_SLAB       = 4,
+    CGMEM_SOCK       = 5,
+    CGMEM_PGFAULT    = 6,
+    CGMEM_PGMAJFAULT = 7,
+    CGMEM_NRSTATS    = 8
+};
+
+/* Keys of a cgroup's io.stat, summed over all devices. */
+enum cg_io {
+    CGIO_RBYTES      = 0,
+    CGIO_WBYTES      = 1,
+    CGIO_RIOS        = 2,
+    CGIO_WIOS        = 3,
+    CGIO_NRSTATS     = 4
+};
+
+/* Files a cgroup had when sampled, bits of gimli_cgroup_t.has. */
+#define CG_HAS_CPU   0x1
+#define CG_HAS_MEM   0x2              // memory.current and memory.stat
+#define CG_HAS_IO    0x4
+#define CG_HAS_PSI   0x8
+
+/* Per-device rates on /disk, see get_diskstats(). */
+enum disk_stat {
+    DISK_READS       = 0,                     // completed reads per second
+    DISK_WRITES      = 1,                     // completed writes per second
+    DISK_READ_BYTES  = 2,                     // bytes read per second
+    DISK_WRITE_BYTES = 3,                     // bytes written per second
+    DISK_READ_AWAIT  = 4,                     // average ms per read
+    DISK_WRITE_AWAIT = 5,                     // average ms per write
+    DISK_UTIL        = 6,                     // percent of time busy
+    DISK_NRSTATS     = 7
+};
+
+/* Columns of /proc/diskstats after the device name, see proc(5). */
+enum disk_field {
+    DISKF_READS      = 0,
+    DISKF_READ_SECT  = 2,
+    DISKF_READ_MS    = 3,
+    DISKF_WRITES     = 4,
+    DISKF_WRITE_SECT = 6,
+    DISKF_WRITE_MS   = 7,
+    DISKF_IO_MS      = 9,
+    DISKF_NR         = 10
 };
 
 typedef enum {
@@ -86,30 +274,557 @@ typedef enum {
     G_FAIL         = 1
 } status_t;
 
+/* Raw jiffy counters of one /proc/stat cpu line, indexed by cpu_util. */
 typedef struct {
-    unsigned long long u, n, s, i, w;
+    unsigned long long t[CPU_NRSTATS];
 } gimli_cpu_t;
 
+/*
+ * Utilization of one core in percent, indexed by cpu_util. Floats keep
+ * two cores per cache line; pct[CPU_IDLE] is negative while offline.
+ */
+typedef struct {
+    float          pct[CPU_NRSTATS];
+} gimli_core_t;
+
+/* Link counters of a network interface. */
+typedef struct {
+    unsigned long long count[NET_NRSTATS];    // totals since boot
+    double         rate[NET_NRSTATS];         // per second, last interval
+} gimli_netstat_t;
+
+/* An interface address, formatted only when rendered. */
+typedef struct {
+    unsigned char  family;                    // AF_INET or AF_INET6
+    unsigned char  addr[16];                  // network byte order
+} gimli_addr_t;
+
+/* A network interface as last reported by rtnetlink. */
 typedef struct {
-    char ifname[IFNAMSIZ];
-    char ipv4[NI_MAXHOST];
-    // char family[NI_MAXSERV];
-    // unsigned tx_packets;
-    // unsigned rx_packets;
-    // unsigned tx_bytes;
-    // unsigned rx_bytes;
+    int            ifindex;
+    char           ifname[IFNAMSIZ];
+    struct timespec ts;                       // when counters were dumped
+    gimli_netstat_t stat;
+    int            primed;                    // stat.count is valid
+    gimli_addr_t  *addr;                      // naddr entries, addrcap room
+    unsigned       naddr;
+    unsigned       addrcap;
+} gimli_link_t;
+
+/* A network interface as published, its addresses are in gimli.netaddr. */
+typedef struct {
+    char           ifname[IFNAMSIZ];
+    unsigned       addr;                      // index of the first address
+    unsigned       naddr;
+    gimli_netstat_t stat;
 } gimli_net_t;
 
+/* A line of a /proc/pressure file, plus what its triggers saw. */
+typedef struct {
+    float          avg[3];                    // % stalled over 10s, 60s, 300s
+    unsigned long long total;                 // us stalled since boot
+    unsigned long long events;                // trigger firings
+    int64_t        last_event;                // ms since the epoch, or 0
+} gimli_psi_t;
+
+/* A PSI trigger, see psi_trigger(). */
+typedef struct {
+    enum psi_res   res;
+    enum psi_kind  kind;
+    unsigned       stall;                     // ms stalled ...
+    unsigned       window;                    // ... within this many ms
+    int            fd;
+} gimli_psitrig_t;
+
+/*
+ * A process as last sampled, private to the scheduler thread. Kept in an
+ * open addressing hash table by pid; starttime tells a reused pid apart.
+ */
+typedef struct {
+    int            pid;                       // 0 free, -1 deleted
+    unsigned       gen;                       // last listing it was in
+    unsigned long long start;                 // starttime in ticks
+    unsigned long long ticks;                 // utime + stime
+    int64_t        ts;                        // mono ms of the last read
+    float          cpu;                       // percent of one core
+    unsigned long long rss;                   // bytes
+    long long      rss_delta;                 // bytes since the last read
+    char           comm[TOP_COMMSIZ];
+} gimli_task_t;
+
+/* A process on /procs/top. */
+typedef struct {
+    int            pid;
+    char           comm[TOP_COMMSIZ];
+    float          cpu;
+    unsigned long long rss;
+    long long      rss_delta;
+} gimli_top_t;
+
+/* A cgroup as published on /cgroups, see cg_read(). */
+typedef struct {
+    char           path[CG_PATHSIZ];          // below the mount, "/" for root
+    unsigned       has;                       // CG_HAS_*
+    float          cpu_pct;                   // percent of one core
+    unsigned long long cpu[CGCPU_NRSTATS];
+    unsigned long long mem_current;           // bytes
+    unsigned long long mem[CGMEM_NRSTATS];
+    unsigned long long io[CGIO_NRSTATS];      // totals
+    float          io_rate[CGIO_NRSTATS];     // per second, last interval
+    gimli_psi_t    psi[PSI_NR][PSI_NRKINDS];  // without events
+} gimli_cgroup_t;
+
+/*
+ * A cgroup directory as watched by the scheduler thread, with an fd
+ * kept open to read its files with openat().
+ */
+typedef struct {
+    int            wd;                        // inotify watch descriptor
+    int            fd;                        // the directory
+    char          *path;                      // below the mount, full
+    int64_t        ts;                        // mono ms of the last sample
+    gimli_cgroup_t cg;
+} gimli_cgnode_t;
+
+/* A line of /proc/meminfo, see meminfo_parse(). */
+typedef struct {
+    char           name[MEMINFO_KEYSIZ];
+    unsigned char  len;                       // strlen(name)
+    unsigned char  bytes;                     // val was in kB, now bytes
+    unsigned long long val;
+} gimli_memfield_t;
+
+/* Rates of a block device over the last interval. */
+typedef struct {
+    char           name[32];
+    float          stat[DISK_NRSTATS];
+} gimli_disk_t;
+
+/* A block device as last sampled, private to get_diskstats(). */
+typedef struct {
+    gimli_disk_t   disk;
+    unsigned long long raw[DISKF_NR];         // counters as last read
+    struct timespec ts;                       // when raw was read
+    int            part;                      // a partition, -1 not known
+    int            seen;                      // present in this sample
+} gimli_diskdev_t;
+
+/* A mounted filesystem as published on /fs, sizes in bytes. */
+typedef struct {
+    char           mount[FS_PATHSIZ];
+    char           source[FS_PATHSIZ];
+    char           fstype[FS_TYPESIZ];
+    unsigned long long size;
+    unsigned long long used;
+    unsigned long long avail;                 // to unprivileged users
+    unsigned long long files;                 // inodes
+    unsigned long long ffree;                 // free inodes
+    int            stale;                     // statvfs() hung, old values
+} gimli_fs_t;
+
+/* A mount as last read from mountinfo, private to the scheduler thread. */
+typedef struct {
+    char          *path;                      // full and unescaped
+    gimli_fs_t     fs;
+    int            valid;                     // sampled, and not a pseudo fs
+    int            seen;                      // still in mountinfo
+} gimli_mount_t;
+
+/* A statvfs() in a batch for a worker thread. */
+typedef struct {
+    char          *path;
+    unsigned       mount;                     // index in the mount table
+    struct statvfs st;
+    int            err;                       // errno of statvfs(), or 0
+} gimli_fsreq_t;
+
+/* A statvfs() worker and its batch, see get_fs(). */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gimli_fsreq_t *req;                       // the scheduler's while idle
+    unsigned       nreq;
+    unsigned       reqcap;
+    unsigned       cur;                       // next one to do, nreq if idle
+    int64_t        since;                     // mono ms req[cur] started
+    int            collected;                 // results taken by fs_done()
+    int            abandoned;                 // hung, exit when through
+    int            exited;                    // worker is gone
+} gimli_fsjob_t;
+
+typedef struct {
+    int            daemon;                    // detach from the terminal
+    unsigned       history;                   // samples kept per metric
+    const char    *listen[SERVER_LISTEN];     // --listen addresses
+    unsigned       nlisten;                   // 0 for dual-stack any
+    unsigned       threads;                   // event loops, 0 for auto
+    cpu_set_t      cpus;                      // to pin event loops to
+    int            backlog;                   // listen() backlog
+    int            partitions;                // report partitions on /disk
+    gimli_psitrig_t psitrig[PSI_MAXTRIG];     // --psi-trigger
+    unsigned       npsitrig;
+} gimli_conf_t;
+
+/*
+ * A /proc file kept open across samples and re-read with pread(), see
+ * proc_read(). Declare with PROC_FILE(path).
+ */
+typedef struct {
+    const char    *path;
+    int            fd;
+    char          *buf;                       // contents, NUL terminated
+    size_t         len;
+    size_t         cap;
+} gimli_proc_t;
+
+#define PROC_FILE(p) { .path = (p), .fd = -1 }
+
+/* Growable, NUL terminated output buffer, see str_printf(). */
+typedef struct {
+    char          *buf;
+    size_t         len;
+    size_t         cap;
+} gimli_str_t;
+
+/* Refcounted, immutable response bytes, see buf_alloc(). */
+typedef struct {
+    atomic_uint    refs;
+    size_t         len;
+    char           data[];
+} gimli_buf_t;
+
+/*
+ * Responses rendered once per publish and served from the cache. The
+ * views of the collectors get the slots from RESP_VIEWS on, in the order
+ * they are registered, see collectors_register().
+ */
+enum resp {
+    RESP_ROOT      = 0,
+    RESP_ERR       = 1,
+    RESP_METRICS   = 2,
+    RESP_VIEWS     = 3,
+    RESP_NR        = 32                       // bits in a dirty mask
+};
+
+#define RESP_BIT(r)  (1u << (r))
+#define RESP_ALL     (~0u)
+
+/* A buffer replaced in the cache, see cache_retire(). */
+typedef struct {
+    gimli_buf_t   *buf;
+    unsigned long  epoch;                     // cache.epoch it was retired at
+} gimli_retired_t;
+
+/*
+ * Buffers are published by swapping pointers and readers never lock; a
+ * replaced buffer is only let go of once no event loop can be about to
+ * take a reference to it, see cache_retire().
+ */
+typedef struct {
+    gimli_buf_t *_Atomic resp[RESP_NR];
+    atomic_ulong   epoch;                     // bumped by every retire
+    gimli_retired_t *retired;                 // only touched by the publisher
+    unsigned       nretired;
+    unsigned       retiredcap;
+} gimli_cache_t;
+
+#define HTTP_HEADMAX 8192             // max size of a request head
+#define HTTP_PATHSIZ 256
+#define HTTP_QUERYSIZ 512
+#define HTTP_NAMESIZ 32               // longer header names are ignored
+#define HTTP_VALSIZ  128              // longer header values are truncated
+
+/* States of the incremental request parser, see http_parse(). */
+enum http_state {
+    HTTP_METHOD        = 0,
+    HTTP_PATH          = 1,
+    HTTP_QUERY         = 2,
+    HTTP_VERSION       = 3,
+    HTTP_HEADER        = 4,
+    HTTP_HEADER_NAME   = 5,
+    HTTP_HEADER_SPACE  = 6,
+    HTTP_HEADER_VALUE  = 7,
+    HTTP_BODY          = 8,
+    HTTP_DONE          = 9,
+    HTTP_ERROR         = 10
+};
+
+enum http_method {
+    HTTP_GET       = 1,
+    HTTP_HEAD      = 2,
+    HTTP_POST      = 3,
+    HTTP_PUT       = 4,
+    HTTP_DELETE    = 5,
+    HTTP_OTHER     = 6
+};
+
+#define HTTP_F_CLOSE      0x1         // 'Connection: close'
+#define HTTP_F_KEEPALIVE  0x2         // 'Connection: keep-alive'
+#define HTTP_F_UPGRADE    0x4         // 'Connection: upgrade'
+#define HTTP_F_WEBSOCKET  0x8         // 'Upgrade: websocket'
+
+/* Opcodes of WebSocket frames (RFC 6455 5.2). */
+enum ws_op {
+    WS_CONT        = 0x0,
+    WS_TEXT        = 0x1,
+    WS_BINARY      = 0x2,
+    WS_CLOSE       = 0x8,
+    WS_PING        = 0x9,
+    WS_PONG        = 0xa
+};
+
+/* Status codes of WebSocket close frames (RFC 6455 7.4.1). */
+#define WS_CLOSE_NORMAL      1000
+#define WS_CLOSE_PROTOCOL    1002
+#define WS_CLOSE_UNSUPPORTED 1003
+#define WS_CLOSE_TOOBIG      1009
+
+/*
+ * Parser state for the request currently arriving on a connection.
+ * Everything up to path is cleared by http_reset(); the buffers are
+ * NUL terminated as they fill.
+ */
+typedef struct {
+    enum http_state state;
+    int            status;                    // answer with this on error
+    int            method;                    // enum http_method
+    int            version;                   // 9, 10 or 11
+    int            flags;                     // HTTP_F_*
+    int            keepalive;                 // set once the head is done
+    uint32_t       hash;                      // route hash of path so far
+    size_t         headlen;                   // bytes of head seen
+    unsigned long long bodylen;               // bytes of body left to skip
+    int            wsversion;                 // Sec-WebSocket-Version
+    char           wskey[WS_KEYLEN + 1];      // Sec-WebSocket-Key
+    size_t         pathlen;
+    size_t         querylen;
+    size_t         namelen;
+    size_t         vallen;
+    char           path[HTTP_PATHSIZ];
+    char           query[HTTP_QUERYSIZ];      // without the '?'
+    char           name[HTTP_NAMESIZ];        // method, then header name
+    char           val[HTTP_VALSIZ];          // version, then header value
+} gimli_http_t;
+
+/* Kinds of objects registered with an event loop's epoll set. */
+enum ev_kind {
+    EV_LISTEN      = 0,
+    EV_CONN        = 1,
+    EV_WAKE        = 2
+};
+
+typedef struct {
+    int            kind;                      // always EV_LISTEN
+    int            fd;
+} gimli_listen_t;
+
+/* An eventfd other threads write to, to get a loop's attention. */
+typedef struct {
+    int            kind;                      // always EV_WAKE
+    int            fd;
+} gimli_wake_t;
+
+/*
+ * A connection following collectors on /stream or /ws. Whatever one of
+ * them publishes that is new is sent as an event, but no sooner than
+ * interval ms after the last events; until then newer events replace
+ * those not sent yet.
+ */
+typedef struct gimli_sub {
+    struct gimli_conn *conn;
+    struct gimli_sub *next;                   // in the loop's subs
+    struct gimli_sub *prev;
+    unsigned       mask;                      // bits of collectors followed
+    unsigned       interval;                  // min ms between events
+    int            ws;                        // events as WebSocket frames
+    int64_t        due;                       // mono ms of the next events
+    unsigned       seen[STREAM_MAXCOLL];      // evseq of the last sent
+} gimli_sub_t;
+
+struct gimli_conn {
+    int            kind;                      // always EV_CONN
+    int            fd;
+    gimli_http_t   req;                       // request being parsed
+    size_t         len;                       // bytes in buf not parsed yet
+    char           buf[CONN_BUFSIZ];
+    gimli_buf_t   *outq[CONN_OUTQ];           // responses, in request order
+    unsigned       outhead;                   // first unsent response
+    unsigned       outcnt;                    // responses queued
+    size_t         outoff;                    // bytes of outq[outhead] sent
+    int            closing;                   // close once outq drains
+    int            paused;                    // reading stopped, outq full
+    struct gimli_loop *loop;                  // that accepted it
+    gimli_sub_t   *sub;                       // set once it is a /stream
+};
+
+typedef struct gimli_conn gimli_conn_t;
+typedef gimli_buf_t *(*gimli_handler_t)(gimli_conn_t *, const gimli_http_t *);
+
+struct gimli_collector;
+
+typedef struct {
+    const char    *path;
+    int            method;                    // enum http_method
+    enum resp      resp;                      // cached response to serve
+    gimli_handler_t handler;                  // or build one with this
+    struct gimli_collector *coll;             // served while it is enabled
+} gimli_route_t;
+
+/*
+ * An endpoint of a collector: rendered into the cache whenever the
+ * collector publishes, or built per request by handler.
+ */
+typedef struct {
+    const char    *path;
+    void         (*render)(gimli_str_t *);
+    gimli_handler_t handler;
+} gimli_view_t;
+
+#define ROUTE_FNV_BASIS 2166136261u
+#define ROUTE_FNV_PRIME 16777619u
+
+/* Perfect hash table over all routes, see router_init(). */
+typedef struct {
+    uint32_t       seed;                      // FNV-1a offset basis used
+    unsigned       mask;                      // table size - 1
+    const gimli_route_t **slot;
+} gimli_router_t;
+
+/* An address to listen on, every event loop binds its own socket to it. */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t      len;
+    int            dual;                      // IPv6 socket takes IPv4 too
+} gimli_bind_t;
+
+typedef struct gimli_loop {
+    int            epfd;
+    unsigned       id;
+    int            cpu;                       // pinned to, -1 if not
+    gimli_listen_t lsn[SERVER_LISTEN];        // own SO_REUSEPORT sockets
+    unsigned       nlsn;
+    gimli_wake_t   wake;                      // new /stream events
+    gimli_sub_t   *subs;                      // its /stream connections
+    atomic_uint    nsubs;
+    int64_t        due;                       // mono ms, held back events
+    atomic_ulong   qs;                        // cache.epoch it woke at, or 0
+} gimli_loop_t;
+
+typedef struct {
+    atomic_ulong   accepted;                  // connections accepted
+    atomic_ulong   served;                    // responses fully sent
+    atomic_ulong   active;                    // connections currently open
+    atomic_ulong   streams;                   // of which /stream
+    unsigned       loops;                     // number of event-loop threads
+    gimli_loop_t *_Atomic loop;               // all of them, once they exist
+} gimli_server_t;
+
+/*
+ * Sequence lock guarding the global gimli_t. Writers serialize on the
+ * mutex and bump seq to an odd value while they update fields; readers
+ * never lock, they copy and retry if seq was odd or moved underneath.
+ * Holders of the mutex (the cache renderers) may read gimli directly.
+ */
+typedef struct {
+    atomic_uint     seq;
+    pthread_mutex_t lock;
+} gimli_seq_t;
+
+/* Metrics with a history, see gimli.hist. */
+enum hist_metric {
+    HIST_CPU       = 0,
+    HIST_LOAD      = 1,
+    HIST_MEM       = 2,
+    HIST_PROCS     = 3,
+    HIST_NR        = 4
+};
+
+/*
+ * Fixed-size ring of past samples of one metric, preallocated by
+ * hist_init(). Each entry is an int64_t timestamp in ms followed by
+ * nfields floats, stride bytes apart.
+ */
+typedef struct {
+    const char    *name;                      // as in /history?metric=
+    const char *const *fields;                // names of the floats
+    unsigned       nfields;
+    int            prec;                      // decimals when rendered
+    unsigned       stride;                    // bytes per entry
+    unsigned       len;                       // entries in ring
+    unsigned long long count;                 // samples ever recorded
+    unsigned char *ring;                      // cache line aligned
+} gimli_hist_t;
+
 typedef struct {
     int            cores;                     // number of cpu's
     long double    cpu[CPU_NRSTATS];          // in percentages
+    gimli_core_t  *percore;                   // per core, cores entries
     float          load[LOAD_NRSTATS];        // straight from /proc/loadavg
-    unsigned long  meminfo[MEM_NRSTATS];      // system memory info in bytes
+    unsigned long  meminfo[MEM_NRSTATS];      // system memory info in KiB
     double         memuse;                    // system memory usage as percent
+    gimli_memfield_t *mem;                    // all of /proc/meminfo
+    unsigned       nmem;                      // lines in mem
+    unsigned       memcap;                    // room in mem
     unsigned long  uptime;                    // system uptime in seconds
     unsigned short procs;                     // number of current processes
-    gimli_net_t    net[255];                  // network interface information
+    gimli_net_t   *net;                       // network interfaces by ifindex
     unsigned       netifs;                    // number of network interfaces
+    unsigned       netcap;                    // room in net
+    gimli_addr_t  *netaddr;                   // addresses of all interfaces
+    unsigned       netaddrs;                  // number of addresses
+    unsigned       netaddrcap;                // room in netaddr
+    gimli_disk_t  *disk;                      // block devices
+    unsigned       ndisks;                    // number of block devices
+    unsigned       diskcap;                   // room in disk
+    gimli_psi_t    psi[PSI_NR][PSI_NRKINDS];  // pressure stall information
+    int            has_psi;                   // psi is valid
+    gimli_top_t    top[TOP_NRKEYS][TOP_MAX];  // busiest processes, by key
+    unsigned       ntop;                      // entries in each top
+    unsigned       ntasks;                    // processes seen in /proc
+    gimli_cgroup_t *cgroup;                   // cgroups, parents first
+    unsigned       ncgroups;                  // number of cgroups
+    unsigned       cgcap;                     // room in cgroup
+    gimli_fs_t    *fs;                        // mounted filesystems
+    unsigned       nfs;                       // number of filesystems
+    unsigned       fscap;                     // room in fs
+    gimli_hist_t   hist[HIST_NR];             // recent samples of metrics
 } gimli_t;
 
+/* What the scheduler does after a collector's event(). */
+enum sched_act {
+    SCHED_NONE     = 0,
+    SCHED_PUBLISH  = 1,                       // the collector's state changed
+    SCHED_SAMPLE   = 2                        // take a sample right away
+};
+
+/*
+ * A collector, see collectors[]. The scheduler thread calls sample() on
+ * every wall clock multiple of interval to update the collector's own
+ * state, and event() whenever an fd it registered with sched_watch() is
+ * ready. After either, publish() copies that state into gimli under the
+ * write lock, and the collector's views, dirty responses and /metrics
+ * are rendered again. Everything but the runtime state is static.
+ */
+typedef struct gimli_collector {
+    const char    *name;                      // as in --interval name=ms
+    unsigned       interval;                  // ms between samples
+    status_t     (*init)(void);               // once, or NULL
+    status_t     (*sample)(void);
+    void         (*publish)(gimli_t *);
+    int          (*event)(int fd, unsigned events);  // enum sched_act
+    void         (*metrics)(gimli_str_t *);   // its part of /metrics, or NULL
+    const gimli_view_t *views;                // ends with a NULL path
+    unsigned       dirty;                     // other responses it feeds
+    unsigned       resp;                      // RESP_BITs of its views
+    atomic_int     disabled;                  // --disable, or at runtime
+    atomic_uint    cost;                      // us the last sample took
+    gimli_buf_t *_Atomic sse;                 // last /stream event
+    gimli_buf_t *_Atomic ws;                  // the same as a WebSocket frame
+    atomic_ullong  evid;                      // their id, see stream_publish()
+    atomic_uint    evseq;                     // odd while they are replaced
+    int            off;                       // init failed
+    int            was_disabled;              // as the scheduler last saw
+    int64_t        next;                      // ms since the epoch
+} gimli_collector_t;
+
 #endif /* GIMLI_H */